@@ -1,24 +1,112 @@
+#include <cstddef>
+#include <stdint.h>
+#include <unordered_map>
+#include <vector>
+
 #include "quadtree.h"
 
-double BoundaryXY_getX(long&);
-double BoundaryXY_getY(long&);
 double size_limit;
 
+// Python object stored in the quadtree with a copy of its coordinates:
+// geometric tests read them here and never call back into Python.
+// Elements inserted in bulk are plain integers: obj is NULL. Every element
+// has an id, given to insert_many or assigned by Quadtree.insert.
+struct PyItem
+{
+  long obj;
+  int64_t id;
+  float x, y;
+};
+
 template<>
-double BoundaryXY<long>::getX(const long& p)
-{ return BoundaryXY_getX(const_cast<long&>(p)); }
+double BoundaryXY<PyItem>::getX(const PyItem& p) { return p.x; }
 template<>
-double BoundaryXY<long>::getY(const long& p)
-{ return BoundaryXY_getY(const_cast<long&>(p)); }
+double BoundaryXY<PyItem>::getY(const PyItem& p) { return p.y; }
 
-SmartQuadtree<long>::iterator masked_begin(
-    SmartQuadtree<long>& q, PolygonMask* p)
-{ return MaskedQuadtree<long>(q, p).begin(); }
+SmartQuadtree<PyItem>::iterator masked_begin(
+    SmartQuadtree<PyItem>& q, PolygonMask* p)
+{ return MaskedQuadtree<PyItem>(q, p).begin(); }
 
-SmartQuadtree<long>::const_iterator masked_const_begin(
-    SmartQuadtree<long>& q, PolygonMask* p)
-{ return MaskedQuadtree<long>(q, p).begin(); }
+SmartQuadtree<PyItem>::const_iterator masked_const_begin(
+    SmartQuadtree<PyItem>& q, PolygonMask* p)
+{ return MaskedQuadtree<PyItem>(q, p).begin(); }
 
 template<>
 bool BoundaryLimit<Boundary>::limitation(const Boundary& box)
 { return (box.norm_infty() < size_limit); }
+
+// Elements inserted with insert_many, by id: they keep their node in the
+// quadtree (see insert()), so that their positions are set in place
+typedef std::unordered_map<int64_t, PyItem*> ItemIndex;
+
+// Inserts n elements known by their ids, and records them in items; an id
+// inserted twice is only recorded for its last element. Runs without the
+// GIL. Returns the number of elements inserted
+std::ptrdiff_t insert_many(SmartQuadtree<PyItem>& q, ItemIndex& items,
+                           const double* x, const double* y,
+                           const int64_t* ids, std::ptrdiff_t n)
+{
+  std::ptrdiff_t inserted = 0;
+  for (std::ptrdiff_t i = 0; i < n; ++i)
+  {
+    PyItem p;
+    p.obj = 0;
+    p.id = ids[i];
+    p.x = x[i];
+    p.y = y[i];
+    const PyItem* ptr = q.insert(p);
+    if (ptr == NULL) continue;
+    items[p.id] = q.access(ptr);
+    ++inserted;
+  }
+  return inserted;
+}
+
+// Sets the coordinates of the elements recorded in items, and moves to
+// another cell only those which left theirs; unknown ids are ignored, and
+// elements leaving the quadtree are forgotten. Runs without the GIL.
+// Returns the number of elements updated
+std::ptrdiff_t update_positions(SmartQuadtree<PyItem>& q, ItemIndex& items,
+                                const int64_t* ids, const double* x,
+                                const double* y, std::ptrdiff_t n)
+{
+  std::ptrdiff_t updated = 0;
+  for (std::ptrdiff_t i = 0; i < n; ++i)
+  {
+    ItemIndex::iterator it = items.find(ids[i]);
+    if (it == items.end()) continue;
+    PyItem* p = it->second;
+    p->x = x[i];
+    p->y = y[i];
+    ++updated;
+    // Data out of the root are dropped by updateData()
+    if (!q.contains(*p)) items.erase(it);
+    q.updateData(*p);
+  }
+  return updated;
+}
+
+// Appends the ids of both elements of a pair to first and second
+struct IdPairs
+{
+  std::vector<int64_t>& first;
+  std::vector<int64_t>& second;
+  IdPairs(std::vector<int64_t>& f, std::vector<int64_t>& s) :
+    first(f), second(s) { }
+  void operator()(const PyItem* a, const PyItem* b)
+  { first.push_back(a->id); second.push_back(b->id); }
+};
+
+// Appends the ids of all pairs of neighbours to first and second, inside
+// mask if not NULL, closer than radius if radius is positive. Runs without
+// the GIL, on one thread so that pairs come in the order of the iterators
+void neighbour_ids(SmartQuadtree<PyItem>& q, PolygonMask* mask, float radius,
+                   std::vector<int64_t>& first, std::vector<int64_t>& second)
+{
+  IdPairs fn(first, second);
+  MaskedQuadtree<PyItem> m(q, mask);
+  if (radius > 0)
+    m.pairsWithin(radius, fn, 1);
+  else
+    m.forEachNeighbourPair(fn, 1);
+}
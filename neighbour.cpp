@@ -9,8 +9,130 @@
 
 #include "neighbour.h"
 
-unsigned int Neighbour::maxlevel = 0;
-unsigned int Neighbour::_x = 0;
-unsigned int Neighbour::_y = 0;
-unsigned int Neighbour::directions[8] = {1, 3, 2, 0, 0, 0, 0, 0};
+#include <algorithm>
+#include <atomic>
+#include <thread>
 
+constexpr unsigned int Neighbour::directions[8];
+
+
+unsigned int Neighbour::interleave(unsigned int x, unsigned int y)
+{
+  // Spread the 16 lower bits of x and y over the even positions
+  x &= 0xffff; y &= 0xffff;
+  x = (x | (x << 8)) & 0x00ff00ff; y = (y | (y << 8)) & 0x00ff00ff;
+  x = (x | (x << 4)) & 0x0f0f0f0f; y = (y | (y << 4)) & 0x0f0f0f0f;
+  x = (x | (x << 2)) & 0x33333333; y = (y | (y << 2)) & 0x33333333;
+  x = (x | (x << 1)) & 0x55555555; y = (y | (y << 1)) & 0x55555555;
+  return x | (y << 1);
+}
+
+namespace
+{
+  typedef std::pair<unsigned int, std::size_t> Code;
+
+  // Sorts [v, v + n) on the bytes of the codes below bit end, least
+  // significant digit first (stable); buffer holds n codes
+  void radix(Code* v, Code* buffer, std::size_t n, unsigned int end)
+  {
+    Code *src = v, *dst = buffer;
+    for (unsigned int shift = 0; shift < end; shift += 8)
+    {
+      std::size_t count[257] = { 0 };
+      for (std::size_t i = 0; i < n; ++i)
+        ++count[((src[i].first >> shift) & 0xff) + 1];
+      // All codes share this byte: nothing to do
+      if (count[((src[0].first >> shift) & 0xff) + 1] == n) continue;
+      for (unsigned int d = 0; d < 256; ++d) count[d + 1] += count[d];
+      for (std::size_t i = 0; i < n; ++i)
+        dst[count[(src[i].first >> shift) & 0xff]++] = src[i];
+      std::swap(src, dst);
+    }
+    if (src != v) std::copy(src, src + n, v);
+  }
+
+  // Counts the most significant bytes of the codes in [first, last)
+  void countTop(const Code* first, const Code* last, std::size_t* count)
+  {
+    for ( ; first != last; ++first) ++count[first->first >> 24];
+  }
+
+  // Moves the codes in [first, last) to their slots in buffer, from the
+  // offsets of their most significant bytes
+  void scatterTop(const Code* first, const Code* last, std::size_t* offset,
+                  Code* buffer)
+  {
+    for ( ; first != last; ++first)
+      buffer[offset[first->first >> 24]++] = *first;
+  }
+
+  // Sorts the ranges of codes sharing their most significant byte, taking
+  // the next one until all are done
+  void sortTops(Code* v, Code* buffer, const std::size_t* start,
+                std::atomic<unsigned int>& next)
+  {
+    for (unsigned int d = next++; d < 256; d = next++)
+      if (start[d + 1] - start[d] > 1)
+        radix(v + start[d], buffer + start[d], start[d + 1] - start[d], 24);
+  }
+}
+
+void Neighbour::sort(std::vector<std::pair<unsigned int, std::size_t> >& v,
+                     unsigned int threads)
+{
+  if (v.size() < 2) return;
+  std::vector<Code> buffer(v.size());
+
+  // Below a few thousand codes per thread, threads cost more than they save
+  if (threads > v.size() / 4096) threads = v.size() / 4096;
+  if (threads < 2)
+  {
+    radix(&v[0], &buffer[0], v.size(), 32);
+    return;
+  }
+
+  // Most significant digit first: each thread counts the bytes of a slice
+  // of the codes, then moves them in place in buffer
+  std::vector<std::size_t> counts(256 * threads, 0);
+  std::vector<std::size_t> bounds(threads + 1);
+  for (unsigned int t = 0; t <= threads; ++t)
+    bounds[t] = t * v.size() / threads;
+
+  std::vector<std::thread> workers;
+  for (unsigned int t = 0; t < threads; ++t)
+    workers.push_back(std::thread(countTop, &v[0] + bounds[t],
+                                  &v[0] + bounds[t + 1], &counts[256 * t]));
+  for (unsigned int t = 0; t < threads; ++t) workers[t].join();
+
+  // Slices keep their order in each range: the sort is stable
+  std::size_t start[257];
+  start[0] = 0;
+  for (unsigned int d = 0; d < 256; ++d)
+  {
+    std::size_t offset = start[d];
+    for (unsigned int t = 0; t < threads; ++t)
+    {
+      std::size_t c = counts[256 * t + d];
+      counts[256 * t + d] = offset;
+      offset += c;
+    }
+    start[d + 1] = offset;
+  }
+
+  workers.clear();
+  for (unsigned int t = 0; t < threads; ++t)
+    workers.push_back(std::thread(scatterTop, &v[0] + bounds[t],
+                                  &v[0] + bounds[t + 1], &counts[256 * t],
+                                  &buffer[0]));
+  for (unsigned int t = 0; t < threads; ++t) workers[t].join();
+
+  // Ranges sharing their most significant byte are sorted on the others
+  std::atomic<unsigned int> next(0);
+  workers.clear();
+  for (unsigned int t = 1; t < threads; ++t)
+    workers.push_back(std::thread(sortTops, &buffer[0], &v[0], start,
+                                  std::ref(next)));
+  sortTops(&buffer[0], &v[0], start, next);
+  for (std::size_t t = 0; t < workers.size(); ++t) workers[t].join();
+  v.swap(buffer);
+}
@@ -10,6 +10,10 @@
 #ifndef NEIGHBOUR_H
 #define NEIGHBOUR_H
 
+#include <cstddef>
+#include <utility>
+#include <vector>
+
 enum Direction {
   EAST, NORTHEAST, NORTH, NORTHWEST, WEST, SOUTHWEST, SOUTH, SOUTHEAST
 };
@@ -17,41 +21,44 @@ enum Direction {
 
 class Neighbour
 {
-  //! Max level generated for _x and _y
-  static unsigned int maxlevel;
-
-  //! Basic movement backwards in x
-  static unsigned int _x;
+  //! Movement backwards in x: all bits of x coordinates (dilated -1)
+  static constexpr unsigned int _x = 0x55555555u;
 
-  //! Basic movement backwards in y
-  static unsigned int _y;
+  //! Movement backwards in y: all bits of y coordinates (dilated -1)
+  static constexpr unsigned int _y = 0xaaaaaaaau;
 
   //! Codes for all direction movements
-  static unsigned int directions[8];
-
-  //! Generates codes for all direction movements
-  static void generate(unsigned int level)
-  {
-    for (unsigned int i = maxlevel; i<=level; ++i)
-    {
-      _x = (_x << 2) + 1;
-      _y = (_y << 2) + 2;
-    }
-    maxlevel  = level;
-    directions[WEST]      = _x;
-    directions[SOUTH]     = _y;
-    directions[NORTHWEST] = directions[NORTH] + directions[WEST];
-    directions[SOUTHWEST] = directions[SOUTH] + directions[WEST];
-    directions[SOUTHEAST] = directions[SOUTH] + directions[EAST];
-  }
+  //! Masks span all levels a code can hold: they are the same at each level
+  static constexpr unsigned int directions[8] = {
+    1,        // EAST
+    1 + 2,    // NORTHEAST
+    2,        // NORTH
+    _x + 2,   // NORTHWEST
+    _x,       // WEST
+    _x + _y,  // SOUTHWEST
+    _y,       // SOUTH
+    _y + 1    // SOUTHEAST
+  };
 
 public:
 
+  //! Number of levels a location code can hold
+  static const unsigned int codelevels = 16;
+
+  //! Yields the location code at level codelevels of cell (x, y) of the grid
+  //! (x bits go to even positions, y bits to odd positions)
+  static unsigned int interleave(unsigned int x, unsigned int y);
+
+  //! Sorts pairs (location code, index) by location code (radix sort)
+  //! Large vectors are shared between the given number of threads
+  static void sort(std::vector<std::pair<unsigned int, std::size_t> >&,
+                   unsigned int threads = 1);
+
   //! Yields the location code for the neighbour of same level in direction dir
+  //! Stateless: safe to call from several threads
   static unsigned int samelevel(unsigned int x, unsigned int dir,
-                                unsigned long level)
+                                unsigned long /* level */)
   {
-    if (level > maxlevel) generate(level);
     return (((x | _y) + (directions[dir] & _x)) & _x) |
       (((x | _x) + (directions[dir] & _y)) & _y);
   }
@@ -1,52 +1,227 @@
 #include "quadtree.h"
 
+#include <algorithm>
 #include <cfloat> // FLT_EPSILON
 
+BlockPool::BlockPool(std::size_t chunkSize, std::size_t blockSize) :
+  chunkSize(chunkSize), blockSize(blockSize), next(NULL), last(NULL)
+{ assert(chunkSize > 0 && blockSize > 0); }
+
+BlockPool::~BlockPool()
+{
+  std::vector<char*>::iterator it = blocks.begin(), ie = blocks.end();
+  for ( ; it != ie; ++it) ::operator delete(*it);
+}
+
+void* BlockPool::allocate()
+{
+  if (!released.empty())
+  {
+    void* chunk = released.back();
+    released.pop_back();
+    return chunk;
+  }
+
+  if (next == last)
+  {
+    // Each new block is twice as large as the previous one, in order to keep
+    // most quadrants in a few large contiguous areas
+    blocks.push_back(static_cast<char*>(::operator new(chunkSize*blockSize)));
+    next = blocks.back();
+    last = next + chunkSize * blockSize;
+    if (blockSize < 4096) blockSize <<= 1;
+  }
+
+  void* chunk = next;
+  next += chunkSize;
+  return chunk;
+}
+
+void BlockPool::release(void* chunk)
+{ released.push_back(chunk); }
+
+void BlockPool::adopt(BlockPool& other)
+{
+  assert(chunkSize == other.chunkSize);
+  blocks.insert(blocks.end(), other.blocks.begin(), other.blocks.end());
+  released.insert(released.end(),
+                  other.released.begin(), other.released.end());
+  // What remains of the current block of other is reused as released chunks
+  for ( ; other.next != other.last; other.next += chunkSize)
+    released.push_back(other.next);
+  other.blocks.clear();
+  other.released.clear();
+  other.next = other.last = NULL;
+}
+
 void PolygonMask::precompute()
 {
   // see http://alienryderflex.com/polygon/
-  int i, j = size - 1;
-
   constant.resize(size);
   multiple.resize(size);
+  previousY.resize(size);
+
+  for (std::size_t r = 0; r + 1 < rings.size(); ++r)
+    for (int i = rings[r], j = rings[r + 1] - 1; i < rings[r + 1]; j = i++)
+    {
+      previousY[i] = polyY[j];
+      if (polyY[j] == polyY[i])
+      {
+        constant[i] = polyX[i];
+        multiple[i] = 0;
+      }
+      else
+      {
+        constant[i] = polyX[i] - (polyY[i] * polyX[j]) / (polyY[j] - polyY[i])
+          + (polyY[i] * polyX[i]) / (polyY[j] - polyY[i]);
+        multiple[i] = (polyX[j] - polyX[i])/(polyY[j] - polyY[i]);
+      }
+    }
 
-  for (i = 0; i < size; ++i)
+  if (size >= indexed) index();
+}
+
+void PolygonMask::index()
+{
+  slabY.assign(polyY.begin(), polyY.begin() + size);
+  std::sort(slabY.begin(), slabY.end());
+  slabY.erase(std::unique(slabY.begin(), slabY.end()), slabY.end());
+
+  // Edge i crosses the slabs from its lower to its upper vertex: counted
+  // first, then filled in place
+  std::size_t nb = slabY.size();
+  slabStart.assign(nb, 0);
+  for (int pass = 0; pass < 2; ++pass)
   {
-    if (polyY[j] == polyY[i])
+    for (int i = 0; i < size; ++i)
+    {
+      float low = std::min(polyY[i], previousY[i]);
+      float high = std::max(polyY[i], previousY[i]);
+      std::size_t k =
+        std::lower_bound(slabY.begin(), slabY.end(), low) - slabY.begin();
+      for ( ; slabY[k] < high; ++k)
+        if (pass == 0) ++slabStart[k + 1];
+        else slabEdges[slabStart[k]++] = i;
+    }
+    if (pass == 0)
     {
-      constant[i] = polyX[i];
-      multiple[i] = 0;
+      for (std::size_t k = 1; k < nb; ++k) slabStart[k] += slabStart[k - 1];
+      slabEdges.resize(slabStart[nb - 1]);
     }
     else
     {
-      constant[i] = polyX[i] - (polyY[i] * polyX[j]) / (polyY[j] - polyY[i])
-        + (polyY[i] * polyX[i]) / (polyY[j] - polyY[i]);
-      multiple[i] = (polyX[j] - polyX[i])/(polyY[j] - polyY[i]);
+      // Each start has moved to the next one
+      for (std::size_t k = nb - 1; k > 0; --k) slabStart[k] = slabStart[k-1];
+      slabStart[0] = 0;
     }
-
-    j = i;
   }
 }
 
+std::atomic<unsigned long> PolygonMask::lastId(0);
+
 PolygonMask::PolygonMask(std::vector<float> x, std::vector<float> y,
-                         int size) : size(size), polyX(x), polyY(y)
+                         int size) : size(size), id(++lastId), polyX(x),
+                                     polyY(y)
+{
+  rings.push_back(0);
+  rings.push_back(size);
+  precompute();
+}
+
+PolygonMask::PolygonMask(const std::vector<std::vector<float> >& x,
+                         const std::vector<std::vector<float> >& y) :
+  size(0), id(++lastId)
+{
+  assert(x.size() == y.size());
+  rings.push_back(0);
+  for (std::size_t r = 0; r < x.size(); ++r)
+  {
+    assert(x[r].size() == y[r].size());
+    polyX.insert(polyX.end(), x[r].begin(), x[r].end());
+    polyY.insert(polyY.end(), y[r].begin(), y[r].end());
+    size += x[r].size();
+    rings.push_back(size);
+  }
+  precompute();
+}
+
+PolygonMask::PolygonMask(const std::vector<float>& x,
+                         const std::vector<float>& y,
+                         const std::vector<int>& rings) :
+  size(x.size()), id(++lastId), polyX(x), polyY(y), rings(rings)
 { precompute(); }
 
 bool PolygonMask::pointInPolygon(float x, float y) const
 {
   // see http://alienryderflex.com/polygon/
-  int i, j = size - 1;
   bool oddNodes = false;
 
-  for (i = 0; i < size; i++)
+  if (!slabY.empty())
+  {
+    // Only edges crossing the slab of y may be on the left of the point
+    std::size_t k =
+      std::lower_bound(slabY.begin(), slabY.end(), y) - slabY.begin();
+    if (k == 0 || k == slabY.size()) return false;
+    for (int e = slabStart[k - 1]; e < slabStart[k]; ++e)
+    {
+      int i = slabEdges[e];
+      oddNodes ^= (y*multiple[i] + constant[i] < x);
+    }
+    return oddNodes;
+  }
+
+  for (int i = 0; i < size; i++)
   {
-    if ((polyY[i] < y && polyY[j] >= y) || (polyY[j] < y && polyY[i] >= y))
+    float py = previousY[i];
+    if ((polyY[i] < y && py >= y) || (py < y && polyY[i] >= y))
       oddNodes ^= (y*multiple[i] + constant[i] < x);
-    j=i;
   }
 
   return oddNodes;
 }
+
+Coverage PolygonMask::classify(const Boundary& box) const
+{
+  // A bit larger than the box, which contains data with a tolerance
+  double x0 = box.getX() - box.getDimX() * 1.0001;
+  double x1 = box.getX() + box.getDimX() * 1.0001;
+  double y0 = box.getY() - box.getDimY() * 1.0001;
+  double y1 = box.getY() + box.getDimY() * 1.0001;
+
+  for (std::size_t r = 0; r + 1 < rings.size(); ++r)
+    for (int i = rings[r], j = rings[r + 1] - 1; i < rings[r + 1]; j = i++)
+    {
+      double ax = polyX[j], ay = polyY[j], bx = polyX[i], by = polyY[i];
+      if ((ax < x0 && bx < x0) || (ax > x1 && bx > x1) ||
+          (ay < y0 && by < y0) || (ay > y1 && by > y1))
+        continue;
+      // The edge misses the box if all corners are strictly on the same side
+      double dx = bx - ax, dy = by - ay;
+      double s[4] = { dx * (y0 - ay) - dy * (x0 - ax),
+                      dx * (y0 - ay) - dy * (x1 - ax),
+                      dx * (y1 - ay) - dy * (x0 - ax),
+                      dx * (y1 - ay) - dy * (x1 - ax) };
+      if ((s[0] > 0 && s[1] > 0 && s[2] > 0 && s[3] > 0) ||
+          (s[0] < 0 && s[1] < 0 && s[2] < 0 && s[3] < 0))
+        continue;
+      return PARTIAL;
+    }
+
+  return (pointInPolygon(box.getX(), box.getY()) ? INSIDE : OUTSIDE);
+}
+
+void PolygonMask::pointsInPolygon(const float* x, const float* y,
+                                  std::size_t n, char* inside) const
+{
+  if (size == 0) { std::fill(inside, inside + n, 0); return; }
+  if (size >= slabbed)
+  {
+    for (std::size_t i = 0; i < n; ++i) inside[i] = pointInPolygon(x[i], y[i]);
+    return;
+  }
+  Simd::pointsInPolygon(&previousY[0], &polyY[0], &constant[0], &multiple[0],
+                        size, x, y, n, inside);
+}
 /*
 std::ostream& operator<<(std::ostream& out, std::vector<float> x)
 {
@@ -59,59 +234,113 @@ std::ostream& operator<<(std::ostream& out, std::vector<float> x)
 }
 */
 
-PolygonMask PolygonMask::clip(const Boundary& box) const
+namespace {
+
+// Sides of the box, one pass of clipping each
+enum Side { LEFT, RIGHT, BOTTOM, UP };
+
+template<Side side>
+inline bool outside(const Boundary& box, float x, float y)
 {
-  // http://en.wikipedia.org/wiki/Sutherland%E2%80%93Hodgman_algorithm
-  std::vector<float> xIn, yIn, xOut = polyX, yOut = polyY;
-
-  std::vector<Boundary::OUTSIDE_TEST> outsideTest;
-  outsideTest.push_back((Boundary::OUTSIDE_TEST) &Boundary::leftOf);
-  outsideTest.push_back((Boundary::OUTSIDE_TEST) &Boundary::rightOf);
-  outsideTest.push_back((Boundary::OUTSIDE_TEST) &Boundary::bottomOf);
-  outsideTest.push_back((Boundary::OUTSIDE_TEST) &Boundary::upOf);
-
-  std::vector<Boundary::INTERSECT> intersect;
-  intersect.push_back((Boundary::INTERSECT) &Boundary::interLeft);
-  intersect.push_back((Boundary::INTERSECT) &Boundary::interRight);
-  intersect.push_back((Boundary::INTERSECT) &Boundary::interBottom);
-  intersect.push_back((Boundary::INTERSECT) &Boundary::interUp);
-
-  // for each edge of the boundary box
-  for (size_t i = 0; i < 4; ++i)
+  return (side == LEFT ? box.leftOf(x, y) :
+          side == RIGHT ? box.rightOf(x, y) :
+          side == BOTTOM ? box.bottomOf(x, y) : box.upOf(x, y));
+}
+
+template<Side side>
+inline void intersect(const Boundary& box, float x1, float y1,
+                      float x2, float y2, float& x, float& y)
+{
+  switch (side)
+  {
+  case LEFT: box.interLeft(x1, y1, x2, y2, x, y); break;
+  case RIGHT: box.interRight(x1, y1, x2, y2, x, y); break;
+  case BOTTOM: box.interBottom(x1, y1, x2, y2, x, y); break;
+  case UP: box.interUp(x1, y1, x2, y2, x, y); break;
+  }
+}
+
+// Clips the n vertices of (xIn, yIn) by one side of the box: the result is
+// appended to (xOut, yOut)
+template<Side side>
+void clipSide(const Boundary& box, const float* xIn, const float* yIn,
+              std::size_t n, std::vector<float>& xOut,
+              std::vector<float>& yOut)
+{
+  if (n == 0) return;
+  float xfrom = xIn[n - 1], yfrom = yIn[n - 1];
+
+  // for each edge of the polygon
+  for (std::size_t k = 0; k < n; ++k)
   {
-    xIn = xOut; yIn = yOut; xOut.clear(); yOut.clear();
-    if (xIn.size() == 0) break;
-    float xfrom = xIn.back(), yfrom = yIn.back();
-    std::vector<float>::iterator xpoly = xIn.begin(), ypoly = yIn.begin();
-    std::vector<float>::iterator xend = xIn.end();
-
-    // for each edge of the polygon
-    for ( ; xpoly != xend ; ++xpoly, ++ypoly)
+    float xpoly = xIn[k], ypoly = yIn[k];
+    if (!outside<side>(box, xpoly, ypoly))
     {
-      if (!(box.*outsideTest[i])(*xpoly, *ypoly))
-      {
-        if ((box.*outsideTest[i])(xfrom, yfrom))
-        {
-          float x, y;
-          (box.*intersect[i])(xfrom, yfrom, *xpoly, *ypoly, x, y);
-          if ((x != *xpoly)||(y != *ypoly))
-          {xOut.push_back(x); yOut.push_back(y);}
-        }
-        xOut.push_back(*xpoly); yOut.push_back(*ypoly);
-      }
-      else if (!(box.*outsideTest[i])(xfrom, yfrom))
+      if (outside<side>(box, xfrom, yfrom))
       {
         float x, y;
-        (box.*intersect[i])(xfrom, yfrom, *xpoly, *ypoly, x, y);
-        if ((x != xfrom)||(y != yfrom))
+        intersect<side>(box, xfrom, yfrom, xpoly, ypoly, x, y);
+        if ((x != xpoly)||(y != ypoly))
         { xOut.push_back(x); yOut.push_back(y); }
       }
-      xfrom = *xpoly; yfrom = *ypoly;
+      xOut.push_back(xpoly); yOut.push_back(ypoly);
+    }
+    else if (!outside<side>(box, xfrom, yfrom))
+    {
+      float x, y;
+      intersect<side>(box, xfrom, yfrom, xpoly, ypoly, x, y);
+      if ((x != xfrom)||(y != yfrom))
+      { xOut.push_back(x); yOut.push_back(y); }
     }
+    xfrom = xpoly; yfrom = ypoly;
+  }
+}
+
+}
+
+int PolygonMask::clip(const Boundary& box, Clipped& out) const
+{
+  // http://en.wikipedia.org/wiki/Sutherland%E2%80%93Hodgman_algorithm
+  out.x.clear(); out.y.clear(); out.rings.assign(1, 0);
+
+  // each ring is clipped on its own; as ever, the last one takes all the
+  // vertices given, even beyond size
+  for (std::size_t r = 0; r + 1 < rings.size(); ++r)
+  {
+    int first = rings[r];
+    int end = (r + 2 < rings.size() ? rings[r + 1] : polyX.size());
 
+    // for each side of the boundary box
+    out.xIn.clear(); out.yIn.clear();
+    clipSide<LEFT>(box, polyX.data() + first, polyY.data() + first, end - first,
+                   out.xIn, out.yIn);
+    out.xMid.clear(); out.yMid.clear();
+    clipSide<RIGHT>(box, out.xIn.data(), out.yIn.data(), out.xIn.size(),
+                    out.xMid, out.yMid);
+    out.xIn.clear(); out.yIn.clear();
+    clipSide<BOTTOM>(box, out.xMid.data(), out.yMid.data(), out.xMid.size(),
+                     out.xIn, out.yIn);
+    clipSide<UP>(box, out.xIn.data(), out.yIn.data(), out.xIn.size(),
+                 out.x, out.y);
+
+    // what remains of a ring outside the box has no area
+    if ((int) out.x.size() - out.rings.back() < 3)
+    {
+      out.x.resize(out.rings.back());
+      out.y.resize(out.rings.back());
+      continue;
+    }
+    out.rings.push_back(out.x.size());
   }
 
-  return PolygonMask(xOut, yOut, xOut.size());
+  return out.x.size();
+}
+
+PolygonMask PolygonMask::clip(const Boundary& box) const
+{
+  Clipped out;
+  clip(box, out);
+  return PolygonMask(out.x, out.y, out.rings);
 }
 
 
@@ -123,41 +352,29 @@ bool Boundary::contains(float x, float y)
           (y > center_y - dim_y * 1.00001));
 }
 
-int Boundary::coveredByPolygon(const PolygonMask& m) const
-{
-  int nb = 0;
-
-  if (m.pointInPolygon(center_x + dim_x, center_y + dim_y)) ++nb;
-  if (m.pointInPolygon(center_x + dim_x, center_y - dim_y)) ++nb;
-  if (m.pointInPolygon(center_x - dim_x, center_y + dim_y)) ++nb;
-  if (m.pointInPolygon(center_x - dim_x, center_y - dim_y)) ++nb;
-
-  return nb;
-}
-
 void Boundary::interLeft(float x1, float y1, float x2, float y2,
-                         float& xout, float& yout)
+                         float& xout, float& yout) const
 {
   xout = center_x - dim_x;
   yout = y1 + (xout - x1) / (x2 - x1) * (y2 - y1);
 }
 
 void Boundary::interRight(float x1, float y1, float x2, float y2,
-                          float& xout, float& yout)
+                          float& xout, float& yout) const
 {
   xout = center_x + dim_x;
   yout = y1 + (xout - x1) / (x2 - x1) * (y2 - y1);
 }
 
 void Boundary::interBottom(float x1, float y1, float x2, float y2,
-                           float& xout, float& yout)
+                           float& xout, float& yout) const
 {
   yout = center_y - dim_y;
   xout = x1 + (yout - y1) / (y2 - y1) * (x2 - x1);
 }
 
 void Boundary::interUp(float x1, float y1, float x2, float y2,
-                       float& xout, float& yout)
+                       float& xout, float& yout) const
 {
   yout = center_y + dim_y;
   xout = x1 + (yout - y1) / (y2 - y1) * (x2 - x1);
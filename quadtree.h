@@ -9,52 +9,483 @@
 #ifndef QUADTREE_H
 #define QUADTREE_H
 
+#include <algorithm>
 #include <cassert>
+#include <cmath>
 #include <cstdlib>
 
+#include <atomic>
+#include <iterator>
+#include <limits>
 #include <list>
 #include <vector>
 #include <iostream>
 #include <unordered_map>
 
 #include "neighbour.h"
+#include "simd.h"
 
 template<class T> class SmartQuadtree;
 template<class T> class MaskedQuadtree;
 
 class Boundary;
 
+/*
+ * Memory pool handing out fixed-size chunks carved from large contiguous
+ * blocks. Released chunks are recycled before new memory is carved.
+ * Quadrants are allocated four siblings at a time, so that a node and its
+ * brothers always share the same cache lines.
+ */
+class BlockPool
+{
+  //! Size in bytes of each chunk
+  std::size_t chunkSize;
+
+  //! Nb of chunks in the next block to be allocated
+  std::size_t blockSize;
+
+  //! Contiguous blocks of memory
+  std::vector<char*> blocks;
+
+  //! Next free byte and end of the last block
+  char *next, *last;
+
+  //! Chunks released, ready for reuse
+  std::vector<void*> released;
+
+  // Non copyable
+  BlockPool(const BlockPool&);
+  BlockPool& operator=(const BlockPool&);
+
+public:
+
+  //! Constructor
+  BlockPool(std::size_t chunkSize, std::size_t blockSize = 16);
+
+  //! Destructor: frees all blocks (no destructor is called on chunks)
+  ~BlockPool();
+
+  //! Returns uninitialised memory for one chunk
+  void* allocate();
+
+  //! Gives back one chunk to the pool
+  void release(void* chunk);
+
+  //! Returns the size in bytes of each chunk
+  std::size_t getChunkSize() const { return chunkSize; }
+
+  //! Takes over all blocks of another pool with chunks of the same size
+  void adopt(BlockPool& other);
+
+};
+
+/*
+ * Contiguous storage for the data attached to a leaf. The array is a chunk
+ * of the pool, sized to the capacity of the quadtree, so that inserting does
+ * not allocate; it only moves to the heap when a cell goes over capacity (see
+ * BoundaryLimit). Removing an element moves the last one into its slot:
+ * addresses of elements are not stable.
+ *
+ * Each element comes with a stamp, stored after the data in the same array,
+ * which iterators use to remember the elements they have already parsed.
+ *
+ * The bucket does not know its pool: it must be emptied with clear() before
+ * being destroyed.
+ */
+template<typename T>
+class Bucket
+{
+  //! Contiguous array of data, followed by the stamps
+  T* data;
+
+  //! Nb of elements in the array
+  unsigned int count;
+
+  //! Nb of elements the array can hold
+  unsigned int room;
+
+  // Non copyable
+  Bucket(const Bucket&);
+  Bucket& operator=(const Bucket&);
+
+  //! Offset in bytes of the stamps in an array of room elements
+  static std::size_t offset(std::size_t room)
+  {
+    return (room * sizeof(T) + sizeof(unsigned int) - 1) /
+      sizeof(unsigned int) * sizeof(unsigned int);
+  }
+
+  //! Returns the nb of elements held by a chunk of the pool
+  static std::size_t pooled(const BlockPool& pool);
+
+  //! Returns the array of stamps
+  inline unsigned int* stamps() const
+  {
+    return reinterpret_cast<unsigned int*>(
+      reinterpret_cast<char*>(data) + offset(room));
+  }
+
+public:
+
+  typedef T* iterator;
+  typedef const T* const_iterator;
+
+  //! Size in bytes of an array of room elements (rounded for alignment)
+  static std::size_t bytes(std::size_t room)
+  { return (offset(room) + room * sizeof(unsigned int) + 15) / 16 * 16; }
+
+  //! Constructor
+  Bucket() : data(NULL), count(0), room(0) {}
+
+  //! Destructor
+  ~Bucket() { assert(NULL == data); }
+
+  //! Returns the number of elements
+  inline std::size_t size() const { return count; }
+
+  //! Returns true if there is no element
+  inline bool empty() const { return 0 == count; }
+
+  inline iterator begin() { return data; }
+  inline iterator end() { return data + count; }
+  inline const_iterator begin() const { return data; }
+  inline const_iterator end() const { return data + count; }
+
+  inline T& back() { assert(count > 0); return data[count - 1]; }
+  inline const T& back() const { assert(count > 0); return data[count - 1]; }
+
+  inline T& operator[](std::size_t i) { return data[i]; }
+  inline const T& operator[](std::size_t i) const { return data[i]; }
+
+  //! Returns the stamp attached to an element
+  inline unsigned int& stamp(const_iterator pos) const
+  { return stamps()[pos - data]; }
+
+  //! Returns the position of the element stored at address p, end() if p
+  //! is not in the array
+  inline iterator at(const T* p)
+  { return (p >= data && p < data + count ? data + (p - data) : end()); }
+
+  //! Addresses of elements change when other elements come and go
+  static const bool stable = false;
+
+  //! Returns true if the next push_back() moves the elements in memory
+  inline bool reallocates() const { return count == room && count > 0; }
+
+  //! Element on its way to a bucket: a copy, with its stamp
+  struct Moving
+  {
+    T data;
+    unsigned int stamp;
+    Moving(const T& data, unsigned int stamp) : data(data), stamp(stamp) {}
+  };
+
+  //! Returns a new element, in no bucket yet
+  static Moving make(const T& elt, unsigned int stamp, BlockPool&)
+  { return Moving(elt, stamp); }
+
+  //! Returns the data of an element on its way
+  static const T& value(const Moving& m) { return m.data; }
+
+  //! Returns the stamp of an element on its way
+  static unsigned int& stamp(Moving& m) { return m.stamp; }
+
+  //! Destroys an element which goes to no bucket
+  static void drop(Moving&, BlockPool&) {}
+
+  //! Appends one element
+  //! Returns true if the previous elements have been moved in memory
+  bool push_back(const T& elt, unsigned int stamp, BlockPool& pool);
+
+  //! Appends one element on its way (see push_back())
+  bool push_back(Moving& m, BlockPool& pool)
+  { return push_back(m.data, m.stamp, pool); }
+
+  //! Takes one element out, the last one takes its place
+  Moving take(iterator pos, BlockPool& pool);
+
+  //! Returns one element to be appended elsewhere; the bucket must then be
+  //! cleared without reading this element again
+  Moving release(iterator pos) { return Moving(*pos, stamp(pos)); }
+
+  //! Removes all elements and gives back the memory
+  void clear(BlockPool& pool);
+
+  //! Exchanges the content of two buckets
+  void swap(Bucket& other);
+
+};
+
+/*
+ * Storage for the data attached to a leaf, one node per element. Nodes are
+ * chunks of the pool and never move: elements keep their node when they go
+ * to another leaf, so that their address stays valid until they are
+ * removed. The leaf only keeps an array of pointers to its nodes, in which
+ * removing an element moves the last pointer into its slot.
+ *
+ * Iterating costs one indirection per element: see BucketType for
+ * switching to flat buckets.
+ */
+template<typename T>
+class NodeBucket
+{
+  //! One element with its stamp
+  struct Node
+  {
+    T data;
+    unsigned int stamp;
+    Node(const T& data, unsigned int stamp) : data(data), stamp(stamp) {}
+  };
+
+  //! Nodes of the elements, in order
+  std::vector<Node*> nodes;
+
+  // Non copyable
+  NodeBucket(const NodeBucket&);
+  NodeBucket& operator=(const NodeBucket&);
+
+public:
+
+  //! Random access iterator on the elements, through the array of nodes
+  template<typename V>
+  class Iterator
+  {
+    Node* const* node;
+
+  public:
+    typedef std::random_access_iterator_tag iterator_category;
+    typedef T value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef V* pointer;
+    typedef V& reference;
+
+    Iterator() : node(NULL) {}
+    explicit Iterator(Node* const* node) : node(node) {}
+    Iterator(const Iterator<T>& other) : node(other.base()) {}
+
+    inline Node* const* base() const { return node; }
+
+    inline V& operator*() const { return (*node)->data; }
+    inline V* operator->() const { return &(*node)->data; }
+    inline V& operator[](std::ptrdiff_t n) const { return node[n]->data; }
+
+    inline Iterator& operator++() { ++node; return *this; }
+    inline Iterator& operator--() { --node; return *this; }
+    inline Iterator operator++(int) { return Iterator(node++); }
+    inline Iterator operator--(int) { return Iterator(node--); }
+    inline Iterator& operator+=(std::ptrdiff_t n) { node += n; return *this; }
+    inline Iterator& operator-=(std::ptrdiff_t n) { node -= n; return *this; }
+    inline Iterator operator+(std::ptrdiff_t n) const
+    { return Iterator(node + n); }
+    inline Iterator operator-(std::ptrdiff_t n) const
+    { return Iterator(node - n); }
+    inline std::ptrdiff_t operator-(const Iterator& other) const
+    { return node - other.node; }
+
+    inline bool operator==(const Iterator& other) const
+    { return node == other.node; }
+    inline bool operator!=(const Iterator& other) const
+    { return node != other.node; }
+    inline bool operator<(const Iterator& other) const
+    { return node < other.node; }
+  };
+
+  typedef Iterator<T> iterator;
+  typedef Iterator<const T> const_iterator;
+
+  //! Size in bytes of the chunk of the pool holding one element
+  static std::size_t bytes(std::size_t) { return sizeof(Node); }
+
+  //! Constructor
+  NodeBucket() {}
+
+  //! Destructor
+  ~NodeBucket() { assert(nodes.empty()); }
+
+  //! Returns the number of elements
+  inline std::size_t size() const { return nodes.size(); }
+
+  //! Returns true if there is no element
+  inline bool empty() const { return nodes.empty(); }
+
+  inline iterator begin() { return iterator(nodes.data()); }
+  inline iterator end() { return iterator(nodes.data() + nodes.size()); }
+  inline const_iterator begin() const
+  { return const_iterator(nodes.data()); }
+  inline const_iterator end() const
+  { return const_iterator(nodes.data() + nodes.size()); }
+
+  inline T& back() { return nodes.back()->data; }
+  inline const T& back() const { return nodes.back()->data; }
+
+  inline T& operator[](std::size_t i) { return nodes[i]->data; }
+  inline const T& operator[](std::size_t i) const { return nodes[i]->data; }
+
+  //! Returns the stamp attached to an element
+  inline unsigned int& stamp(const_iterator pos) const
+  { return (*pos.base())->stamp; }
+
+  //! Returns the position of the element stored at address p, end() if p
+  //! is not in the bucket
+  iterator at(const T* p);
+
+  //! Addresses of elements do not change when other elements come and go
+  static const bool stable = true;
+
+  //! Elements never move in memory
+  inline bool reallocates() const { return false; }
+
+  //! Element on its way to a bucket: its node, which it keeps
+  typedef Node* Moving;
+
+  //! Returns a new element, in no bucket yet
+  static Moving make(const T& elt, unsigned int stamp, BlockPool& pool)
+  { return new (pool.allocate()) Node(elt, stamp); }
+
+  //! Returns the data of an element on its way
+  static const T& value(const Moving& m) { return m->data; }
+
+  //! Returns the stamp of an element on its way
+  static unsigned int& stamp(Moving& m) { return m->stamp; }
+
+  //! Destroys an element which goes to no bucket
+  static void drop(Moving& m, BlockPool& pool)
+  { m->~Node(); pool.release(m); }
+
+  //! Appends one element
+  //! Returns false: the previous elements never move in memory
+  bool push_back(const T& elt, unsigned int stamp, BlockPool& pool)
+  { nodes.push_back(make(elt, stamp, pool)); return false; }
+
+  //! Appends one element on its way, in its own node
+  bool push_back(Moving& m, BlockPool&)
+  { nodes.push_back(m); return false; }
+
+  //! Takes one element out with its node, the last one takes its place in
+  //! the order
+  Moving take(iterator pos, BlockPool& pool);
+
+  //! Returns one element to be appended elsewhere with its node; the bucket
+  //! must then be cleared without reading this element again
+  Moving release(iterator pos);
+
+  //! Removes all elements and gives back the memory
+  void clear(BlockPool& pool);
+
+  //! Exchanges the content of two buckets
+  void swap(NodeBucket& other) { nodes.swap(other.nodes); }
+
+};
+
+//! Coverage of a boundary box by a polygon mask
+enum Coverage { OUTSIDE, PARTIAL, INSIDE };
+
+/*
+ * Polygon made of one or several rings: a point is inside if it is inside an
+ * odd number of rings, so that rings may be separate parts or holes.
+ * Large polygons are cut in slabs between the ordinates of their vertices,
+ * each slab listing the edges crossing it: a point is tested against the
+ * edges of its slab only.
+ */
 class PolygonMask
 {
 private:
   //! Nb of vertices in the polygon
   int size;
 
+  //! Identifies the polygon in caches of coverage (shared by copies)
+  unsigned long id;
+
+  //! Last id given to a polygon
+  static std::atomic<unsigned long> lastId;
+
   //! Coordinates of the vertices of the polygon
   std::vector<float> polyX, polyY;
 
-  //! Auxiliary variables
-  std::vector<float> constant, multiple;
+  //! Index of the first vertex of each ring, then size
+  std::vector<int> rings;
+
+  //! Auxiliary variables, for the edge from the previous vertex to vertex i
+  std::vector<float> constant, multiple, previousY;
+
+  //! Ordinates of vertices, sorted without duplicates (empty if not indexed)
+  std::vector<float> slabY;
+
+  //! Edges crossing the slab between slabY[k] and slabY[k+1] are
+  //! slabEdges[slabStart[k]] to slabEdges[slabStart[k+1]] excluded
+  std::vector<int> slabStart, slabEdges;
+
+  //! Smallest polygons for which slabs are built
+  static const int indexed = 16;
+
+  //! Smallest polygons for which batches are tested slab by slab rather
+  //! than against all edges at once in vector registers
+  static const int slabbed = 128;
 
   // see http://alienryderflex.com/polygon/
   void precompute();
 
+  // Builds the slabs
+  void index();
+
+  // Constructor from vertices ring after ring, as in rings
+  PolygonMask(const std::vector<float>& x, const std::vector<float>& y,
+              const std::vector<int>& rings);
+
 public:
 
+  //! Buffers filled by clip(), to be reused from one call to the next
+  struct Clipped
+  {
+    //! Vertices of the clipped rings, one after the other
+    std::vector<float> x, y;
+
+    //! Index of the first vertex of each clipped ring, then their number
+    std::vector<int> rings;
+
+    //! Vertices between two sides of the box
+    std::vector<float> xIn, yIn, xMid, yMid;
+  };
+
   //! Constructor
   PolygonMask(std::vector<float> x, std::vector<float> y, int size);
 
+  //! Constructor of a polygon with several rings (parts or holes)
+  PolygonMask(const std::vector<std::vector<float> >& x,
+              const std::vector<std::vector<float> >& y);
+
   //! Return the number of vertices of the polygon
   int getSize() const { return size; }
 
+  //! Return the number of rings of the polygon
+  int getRings() const { return rings.size() - 1; }
+
+  //! Returns an identifier unique to this polygon (and its copies)
+  unsigned long getId() const { return id; }
+
+  //! Returns the coverage of the box by the polygon: PARTIAL if an edge of
+  //! the polygon meets the box, INSIDE or OUTSIDE as its center otherwise
+  Coverage classify(const Boundary& box) const;
+
   //! Returns whether a point of coordinates (x, y) is inside the polygon
   // see http://alienryderflex.com/polygon/
   bool pointInPolygon(float x, float y) const;
 
+  //! Writes in inside[i] whether (x[i], y[i]) is inside the polygon, for all
+  //! i < n: same as pointInPolygon, several data at a time (SSE2/AVX2)
+  void pointsInPolygon(const float* x, const float* y, std::size_t n,
+                       char* inside) const;
+
   //! Returns a different polygon mask clipped by the boundary box
   // see http://en.wikipedia.org/wiki/Sutherland%E2%80%93Hodgman_algorithm
   PolygonMask clip(const Boundary& box) const;
 
+  //! Clips the polygon by the boundary box into out, which allocates nothing
+  //! once its buffers are large enough; rings with no area left are dropped
+  //! Returns the number of vertices of the clipped polygon
+  //! (classify() tells how the box is covered without clipping)
+  int clip(const Boundary& box, Clipped& out) const;
+
   friend class Test_PolygonMask;
 
 };
@@ -83,9 +514,6 @@ class Boundary
   //! Store the result of limitation in order to avoid recomputation
   bool limit;
 
-  //! Return the number of points covered by the polygon mask m
-  int coveredByPolygon(const PolygonMask& m) const;
-
 public:
 
   //! Default constructor
@@ -135,23 +563,16 @@ public:
   bool upOf(float x, float y) const { return (y > center_y+dim_y+1e-4); }
 
   //! Returns the intersection with the left boundary of the box
-  void interLeft(float, float, float, float, float&, float&);
+  void interLeft(float, float, float, float, float&, float&) const;
 
   //! Returns the intersection with the right boundary of the box
-  void interRight(float, float, float, float, float&, float&);
+  void interRight(float, float, float, float, float&, float&) const;
 
   //! Returns the intersection with the bottom boundary of the box
-  void interBottom(float, float, float, float, float&, float&);
+  void interBottom(float, float, float, float, float&, float&) const;
 
   //! Returns the intersection with the up boundary of the box
-  void interUp(float, float, float, float, float&, float&);
-
-  //! Types of methods leftOf, rightOf, bottomOf, upOf
-  typedef bool (Boundary::*OUTSIDE_TEST) (float, float) const;
-
-  //! Types of methods interLeft, interRight, interBottom, interUp
-  typedef bool (Boundary::*INTERSECT)
-    (float, float, float, float, float&, float&) const;
+  void interUp(float, float, float, float, float&, float&) const;
 
   template<typename T> friend class SmartQuadtree;
   template<typename T>
@@ -187,9 +608,36 @@ template<typename T> struct TypeDescriptor
   static const_pointer getPtr(const T& p) { return &p; }
 };
 
+/*
+ * Storage of the data of each leaf. By default, data live in nodes which
+ * never move (see NodeBucket): pointers returned by insert() stay valid until
+ * the data is removed. If you do not keep such pointers, flat buckets are
+ * faster to iterate on; you can then write something like:
+ *
+ * template<>
+ * struct BucketType<MyClass>
+ * {
+ *   typedef Bucket<MyClass> type;
+ * };
+ */
+
+template<typename T> struct BucketType
+{
+  typedef NodeBucket<T> type;
+};
+
 template<typename T>
 class SmartQuadtree
 {
+  // Data shared by all nodes of a quadtree, owned by the root
+  struct Tree;
+
+  // Storage used for building a subtree apart from the rest of the tree
+  struct Loader;
+
+  // Storage for the data of a leaf (see BucketType)
+  typedef typename BucketType<T>::type Storage;
+
   // Delimitates the quadrant
   Boundary b;
 
@@ -197,7 +645,7 @@ class SmartQuadtree
   std::size_t location;
 
   // Current level of the quadrant
-  std::size_t level;
+  unsigned char level;
 
   // Level differences with the neighbours
   // 0: adjacent quadrant is of same level
@@ -205,28 +653,221 @@ class SmartQuadtree
   // 2: adjacent quadrant is out of area
   // 3: adjacency is not reflexive (diagonal)
   // -1, ...: adjacent quadrant is of smaller level by -n (i.e. larger in size)
-  int delta[8];
+  signed char delta[8];
+
+  // Children nodes, four contiguous siblings taken from the pool
+  // SW -> 0, SE -> 1, NW -> 2, NE -> 3
+  SmartQuadtree<T>* children;
 
-  // Children nodes
-  SmartQuadtree<T> *children[4];
+  // Parent node (NULL for the root)
+  SmartQuadtree<T>* parent;
 
   // Directions corresponding to children nodes
   static const unsigned char diags[4];
 
   // Data attached to the quadrant
-  std::list<T> points;
+  Storage points;
 
-  // We keep a map of who is where
-  std::unordered_map<typename TypeDescriptor<T>::const_pointer, SmartQuadtree*> where;
+  // Position in the list of leaves (only meaningful for leaves)
+  typename std::list<SmartQuadtree<T>*>::iterator leaf;
 
-  // All leaves of the Quadtree, in order
-  std::list<SmartQuadtree*> leaves;
+  // Shared data (root, leaves, where, capacity, pools)
+  Tree* tree;
 
-  // Capacity of each cell
-  const unsigned int capacity;
+  // Coverage by the last mask checked, as (id << 2) | Coverage (0: none)
+  // Boundaries never change: quadrants built by subdivisions start afresh
+  mutable std::atomic<unsigned long> covered;
+
+  // Returns the coverage of the quadrant by mask, cached for the last mask
+  Coverage coverage(const PolygonMask& mask) const;
+
+  // Is this quadrant q or one of its ancestors?
+  bool ancestorOf(const SmartQuadtree<T>* q) const
+  {
+    return (q->level >= level &&
+            (q->location >> (2 * (q->level - level))) == location);
+  }
 
-  // Ancestor
-  SmartQuadtree<T>* ancestor;
+  // Moves leaf to the first leaf from leaf on not outside mask, skipping
+  // whole subtrees outside mask; sets inside to the largest subtree inside
+  // mask starting with leaf, unless leaf is already below inside
+  template<typename LeafIterator>
+  static Coverage enter(LeafIterator& leaf, const LeafIterator& end,
+                        const PolygonMask& mask,
+                        const SmartQuadtree<T>*& inside);
+
+  // Appends the leaves of the subtree not outside mask, in the order of the
+  // list of leaves; leaves of subtrees inside mask are cached as such
+  void collect(const PolygonMask& mask,
+               std::vector<const SmartQuadtree<T>*>& leaves,
+               bool inside = false) const;
+
+  // Shapes of range queries: classify() tells how a quadrant is covered,
+  // contains() whether a piece of data is inside
+  struct Rect;
+  struct Circle;
+  struct Corridor;
+
+  // Appends the data it is called on to a vector
+  struct Append;
+
+  // Calls fn on data of the subtree inside shape; data of quadrants inside
+  // shape are taken without testing them
+  template<typename Shape, typename Function>
+  void query(const Shape& shape, Function& fn, bool inside = false) const;
+
+  // Returns the leaf of the subtree holding (x, y), clamped to the quadrant;
+  // on a border, the leaf ahead in direction (dx, dy)
+  const SmartQuadtree<T>* locate(double x, double y,
+                                 double dx = 0, double dy = 0) const;
+
+  // Calls fn on the leaves crossed by the segment of corridor, in order,
+  // walking from one leaf to its neighbour through samelevel
+  template<typename Function>
+  void crossed(const Corridor& corridor, Function& fn) const;
+
+  // State of nearest neighbour searches, reused from one search to the next
+  struct Nearest
+  {
+    // Quadrants to visit, as a heap on their squared distance to the query
+    std::vector<std::pair<float, const SmartQuadtree<T>*> > queue;
+    // Closest data found so far, as a heap on their squared distance
+    std::vector<std::pair<float, typename TypeDescriptor<T>::const_pointer> >
+      best;
+    // Data put in best before the search started
+    std::vector<typename TypeDescriptor<T>::const_pointer> seeds;
+  };
+
+  // Returns the squared distance from (x, y) to the quadrant
+  float distance2(float x, float y) const;
+
+  // Puts in nearest.best the k data of the subtree closest to (x, y),
+  // closest first; data in nearest.seeds are already there with their
+  // distances, and prune quadrants from the start
+  void search(float x, float y, std::size_t k, Nearest& nearest) const;
+
+  // Returns the location code at level Neighbour::codelevels of (x, y),
+  // clamped to the quadrant
+  unsigned int code(double x, double y) const;
+
+  // Appends the location codes of data in [first, last) inside the quadrant
+  // to codes, with their indices
+  void encode(const std::vector<T>& data, std::size_t first, std::size_t last,
+              std::vector<std::pair<unsigned int, std::size_t> >& codes);
+
+  // Inserts one piece of data on its way, with the stamp of the last sweep
+  // parsing it; it is left to the caller if it is outside
+  typename TypeDescriptor<T>::const_pointer
+  insert(typename Storage::Moving&);
+
+  // Stores one piece of data in the current quadrant, and in the where map
+  typename TypeDescriptor<T>::const_pointer
+  attach(typename Storage::Moving&);
+
+  // Takes one piece of data out of the current quadrant and the where map
+  typename Storage::Moving detach(typename Storage::iterator);
+
+  // Finds one piece of data in the current quadrant
+  typename Storage::iterator lookup(const T&);
+
+  // Inserts data which left the current quadrant from the closest ancestor
+  // containing it; data out of the root are destroyed
+  typename TypeDescriptor<T>::const_pointer
+  reinsert(typename Storage::Moving&);
+
+  // Builds the map of who is where if it has not been maintained
+  void index();
+
+  // Computes the statistics of the tree again from the list of leaves
+  void recount();
+
+  // Splits a leaf into four children leaves, without moving data
+  void subdivide(std::list<SmartQuadtree<T>*>& leaves, BlockPool& quadrants);
+
+  // Builds the subtree holding data of sorted codes in [first, last)
+  // Quadrants of level stop needing a split are left in tasks; data which
+  // need deeper levels are left in the strays of the loader
+  void bulk(Loader& loader, std::size_t first, std::size_t last,
+            unsigned char stop, std::vector<SmartQuadtree<T>*>& tasks);
+
+  // Builds the subtrees in tasks not taken yet by another thread
+  static void work(const std::vector<SmartQuadtree<T>*>& tasks,
+                   const std::vector<Loader*>& loaders,
+                   std::atomic<std::size_t>& next);
+
+  // Computes the deltas of all quadrants in the subtree, down to level stop
+  void computeDeltas(unsigned char stop = 255);
+
+  // Computes the deltas in the subtrees of tasks not taken by another thread
+  static void computeDeltas(const std::vector<SmartQuadtree<T>*>& tasks,
+                            std::atomic<std::size_t>& next);
+
+  // Scratch space of a thread visiting pairs, reused from leaf to leaf
+  struct Scratch
+  {
+    // Indices of data inside the mask in leaves partially covered
+    std::vector<std::size_t> kept;
+    // Coordinates of data gathered from a leaf and its neighbours
+    std::vector<float> x, y;
+    std::vector<typename TypeDescriptor<T>::const_pointer> data;
+    // Indices yielded by Simd kernels
+    std::vector<unsigned int> hits;
+    // Coordinates of data tested against the mask, and the results
+    std::vector<float> px, py;
+    std::vector<char> inside;
+  };
+
+  // Writes in inside whether data in [first, last) are inside mask, through
+  // their coordinates copied in x and y
+  static void inPolygon(const PolygonMask& mask,
+                        typename Storage::const_iterator first,
+                        typename Storage::const_iterator last,
+                        std::vector<float>& x, std::vector<float>& y,
+                        std::vector<char>& inside);
+
+  // Calls fn on pairs of neighbours yielded by forward_begin() for data of
+  // this leaf, walking buckets in place
+  template<typename Function>
+  void visitPairs(PolygonMask* mask, Function& fn, Scratch& scratch) const;
+
+  // Same as visitPairs for pairs closer than radius only
+  template<typename Function>
+  void visitWithin(PolygonMask* mask, float radius, Function& fn,
+                   Scratch& scratch) const;
+
+  // Appends coordinates of data visited in this leaf to scratch, and writes
+  // their extent in box (min x, max x, min y, max y)
+  void gather(Scratch& scratch, bool partial, std::size_t first,
+              std::size_t last, float* box) const;
+
+  // Returns false if mask leaves none of the data of this leaf; partial is
+  // set if only the data indexed in scratch.kept[first, last) are inside mask
+  bool visitedData(PolygonMask* mask, Scratch& scratch, bool& partial,
+                   std::size_t& first, std::size_t& last) const;
+
+  // Calls fn on pairs of neighbours of leaves in chunks delimited by bounds,
+  // taking chunks not taken by another thread
+  // (all of them if radius is negative)
+  template<typename Function, typename LeafIterator>
+  static void visitChunks(const std::vector<LeafIterator>& bounds,
+                          PolygonMask* mask, float radius, Function* fn,
+                          std::atomic<std::size_t>& next);
+
+  // Shares the leaves in [first, last) between threads, see visitChunks
+  template<typename Function, typename LeafIterator>
+  static void visitLeaves(LeafIterator first, LeafIterator last,
+                          std::size_t size, Function& fn,
+                          unsigned int threads, PolygonMask* mask,
+                          float radius);
+
+  // See forEachNeighbourPair and pairsWithin
+  template<typename Function>
+  void visit(Function& fn, unsigned int threads, PolygonMask* mask,
+             float radius = -1) const;
+
+  // Non copyable
+  SmartQuadtree<T>(const SmartQuadtree<T>&);
+  SmartQuadtree<T>& operator=(const SmartQuadtree<T>&);
 
   //! Increments the delta in direction dir
   //! Returns true if you have children
@@ -239,6 +880,16 @@ class SmartQuadtree
   //! children nodes
   void updateDelta(unsigned char dir);
 
+  //! Computes the delta in direction dir from the structure of the tree
+  signed char computeDelta(unsigned char dir) const;
+
+  //! Recomputes the deltas of the leaves along the side facing direction dir
+  void refreshDelta(unsigned char dir);
+
+  //! Moves the data of the four children (leaves) back to the current
+  //! quadrant and frees them
+  void merge();
+
 public:
 
   struct const_iterator;
@@ -248,19 +899,28 @@ public:
   SmartQuadtree<T>(float center_x, float center_y, float dim_x, float dim_y,
                 unsigned int capacity) :
     b(center_x, center_y, dim_x, dim_y), location(0), level(0),
-    capacity(capacity), ancestor(this)
+    children(NULL), parent(NULL), tree(new Tree(this, capacity)), covered(0)
   {
-    children[0] = NULL; children[1] = NULL;
-    children[2] = NULL; children[3] = NULL;
     delta[0] = 2; delta[1] = 2; delta[2] = 2; delta[3] = 2;
     delta[4] = 2; delta[5] = 2; delta[6] = 2; delta[7] = 2;
-    leaves.push_back(this);
+    leaf = tree->leaves.insert(tree->leaves.end(), this);
   }
 
-  //! Constructor of a child quadtree
+  //! Constructor loading all data in [first, last) at once
+  //! Data are sorted by location code, then all quadrants are built in one
+  //! pass.
+  //! Subtrees are built by the given number of threads (0: one per core).
+  template<typename InputIterator>
+  SmartQuadtree<T>(float center_x, float center_y, float dim_x, float dim_y,
+                   unsigned int capacity,
+                   InputIterator first, InputIterator last,
+                   unsigned int threads = 1);
+
+  //! Constructor of a child quadtree, inserted in leaves before w
   // SW -> 0, SE -> 1, NW -> 2, NE -> 3
   SmartQuadtree<T>(const SmartQuadtree<T>&, unsigned char,
-                   typename std::list<SmartQuadtree<T>*>::iterator&);
+                   std::list<SmartQuadtree<T>*>& leaves,
+                   typename std::list<SmartQuadtree<T>*>::iterator& w);
 
   //! Destructor
   ~SmartQuadtree<T>();
@@ -281,15 +941,43 @@ public:
   SmartQuadtree<T>* samelevel(unsigned char) const;
 
   //! Insert one piece of data to the quadrant
-  //! Returns true if the data has been inserted
+  //! Returns a pointer to the data inserted, NULL if it is outside.
+  //! Unless T is itself a handle (e.g. a pointer, see TypeDescriptor), the
+  //! pointer is into the node of the data: it is valid until the data is
+  //! removed, wherever it moves in the meantime. With flat buckets (see
+  //! BucketType), it is invalidated by any change in the quadtree.
   typename TypeDescriptor<T>::const_pointer insert(T);
 
   //! Removes a data in current subtree
+  //! With flat buckets, the last data of the leaf takes its place in
+  //! memory (see insert())
+  //! The first call builds the map of who is where, which every insertion
+  //! and move maintains from then on
   void removeData(T& p);
 
   //! Update the structure of the quadtree if an element moved from elsewhere
   bool updateData(T& p);
 
+  //! Mutable access to the data at p, as returned by insert(), e.g. to move
+  //! it before calling updateData(); NULL if the data is not in the quadtree
+  //! Builds the map of who is where on the first call, as removeData() does
+  T* access(typename TypeDescriptor<T>::const_pointer p);
+
+  //! Update the structure of the whole quadtree after elements have moved
+  //! All leaves are scanned once; elements out of their cell are collected,
+  //! then inserted again from their closest enclosing ancestor.
+  //! Returns the number of elements which changed cells
+  unsigned long rebalance();
+
+  //! Merges back sibling leaves which hold together at most lowWater elements
+  //! Keep lowWater below the capacity so that cells do not split and merge
+  //! again at each frame. Do not call while iterating.
+  //! Returns the number of merged quadrants
+  unsigned long coarsen(unsigned int lowWater);
+
+  //! Merges back sibling leaves holding at most half the capacity
+  unsigned long coarsen() { return coarsen(tree->capacity / 2); }
+
   //! Returns true if the current cell may contain the data
   bool contains(const T& p) { return b.contains(p); }
 
@@ -298,13 +986,13 @@ public:
                                 unsigned short level) const;
 
   //! Returns the data embedded to current quadrant
-  inline const std::list<T>& getPoints() const { return points; }
+  inline const Storage& getPoints() const { return points; }
 
   //! Returns a point to the proper child 0->SW, 1->SE, 2->NW, 3->NE
   inline const SmartQuadtree<T>* getChild(unsigned char i) const
   {
     assert (i<4);
-    return children[i];
+    return (NULL == children ? NULL : children + i);
   }
 
   //! Get the location
@@ -314,15 +1002,116 @@ public:
   inline unsigned char getLevel() const { return level; }
 
   //! Get the max size of children data lists
+  //! Constant time on the root, see stats()
   unsigned long getDataSize() const;
 
   //! Get the depth of the quadtree
+  //! Constant time on the root, see stats()
   unsigned char getDepth() const;
 
+  //! Figures about the whole quadtree
+  struct Stats
+  {
+    //! Number of data
+    unsigned long size;
+    //! Number of leaves
+    unsigned long leaves;
+    //! Max size of the data lists of the leaves
+    unsigned long fullest;
+    //! Level of the deepest leaf
+    unsigned char depth;
+  };
+
+  //! Get the figures about the whole quadtree, whatever the node called
+  //! They are maintained as data come and go: this is constant time.
+  Stats stats() const;
+
   //! Mask the quadtree
   MaskedQuadtree<T> masked(PolygonMask* m)
   { return MaskedQuadtree<T>(*this, m); }
 
+  //! Calls fn(a, b) with a and b of type TypeDescriptor<T>::const_pointer
+  //! for each pair of neighbours yielded by forward_begin()/forward_end()
+  //! Chunks of leaves are shared between threads (0: one per core): the same
+  //! fn is called concurrently and must be thread-safe.
+  template<typename Function>
+  void forEachNeighbourPair(Function fn, unsigned int threads = 0) const
+  { visit(fn, threads, NULL); }
+
+  //! Same as forEachNeighbourPair for pairs closer than radius only
+  //! Neighbour leaves farther than radius from a data are skipped at once
+  template<typename Function>
+  void pairsWithin(float radius, Function fn, unsigned int threads = 0) const
+  { visit(fn, threads, NULL, radius); }
+
+  //! Calls fn(p) with p of type TypeDescriptor<T>::const_pointer for each
+  //! data of the subtree inside box, borders included
+  //! Only quadrants overlapping box are visited, and data of quadrants
+  //! inside box are not tested one by one.
+  template<typename Function>
+  void queryRect(const Boundary& box, Function fn) const
+  { query(Rect(box), fn); }
+
+  //! Appends to out the data of the subtree inside box, borders included
+  void queryRect(const Boundary& box,
+                 std::vector<typename TypeDescriptor<T>::const_pointer>& out)
+    const
+  { Append fn(out); query(Rect(box), fn); }
+
+  //! Calls fn(p) for each data of the subtree closer than r to (x, y)
+  //! Quadrants are pruned or taken whole as in queryRect
+  template<typename Function>
+  void queryRadius(float x, float y, float r, Function fn) const
+  { query(Circle(x, y, r), fn); }
+
+  //! Appends to out the data of the subtree closer than r to (x, y)
+  void queryRadius(float x, float y, float r,
+                   std::vector<typename TypeDescriptor<T>::const_pointer>& out)
+    const
+  { Append fn(out); query(Circle(x, y, r), fn); }
+
+  //! Calls fn(p) with p of type TypeDescriptor<T>::const_pointer for each
+  //! data of the subtree closer than r to the segment from (x0, y0) to
+  //! (x1, y1), e.g. along the path of a track for the next seconds
+  //! Quadrants are pruned or taken whole as in queryRect
+  template<typename Function>
+  void queryCorridor(float x0, float y0, float x1, float y1, float r,
+                     Function fn) const
+  { query(Corridor(x0, y0, x1, y1, r), fn); }
+
+  //! Appends to out the data of the subtree closer than r to the segment
+  //! from (x0, y0) to (x1, y1)
+  void queryCorridor(
+    float x0, float y0, float x1, float y1, float r,
+    std::vector<typename TypeDescriptor<T>::const_pointer>& out) const
+  { Append fn(out); query(Corridor(x0, y0, x1, y1, r), fn); }
+
+  //! Calls fn(leaf) with leaf of type const SmartQuadtree<T>* for each leaf
+  //! of the quadtree crossed by the segment from (x0, y0) to (x1, y1), in
+  //! order from (x0, y0) on
+  //! Leaves are walked from one to its neighbour through samelevel(): only
+  //! the leaves crossed are visited.
+  template<typename Function>
+  void forEachLeafAlong(float x0, float y0, float x1, float y1,
+                        Function fn) const
+  { tree->root->crossed(Corridor(x0, y0, x1, y1, 0), fn); }
+
+  //! Writes in out the k data of the subtree closest to (x, y), closest
+  //! first (all of them if the subtree holds fewer data)
+  //! Quadrants are visited by increasing distance, until the next one is
+  //! farther than the k-th closest data found so far.
+  void nearest(float x, float y, std::size_t k,
+               std::vector<typename TypeDescriptor<T>::const_pointer>& out)
+    const;
+
+  //! Same as nearest for the n positions (x[i], y[i]): out holds k data for
+  //! each position in turn (NULL past the data of the subtree)
+  //! Positions are searched in the order of their location codes, each
+  //! search being bounded from the start by the answer to the previous one.
+  void nearest(const float* x, const float* y, std::size_t n, std::size_t k,
+               std::vector<typename TypeDescriptor<T>::const_pointer>& out)
+    const;
+
   friend std::ostream& operator<<<> (std::ostream&, const SmartQuadtree<T>&);
 
   friend class MaskedQuadtree<T>;
@@ -333,6 +1122,243 @@ public:
 
 };
 
+template<class T>
+struct SmartQuadtree<T>::Tree
+{
+  // Root of the quadtree
+  SmartQuadtree<T>* root;
+
+  // Capacity of each cell
+  const unsigned int capacity;
+
+  // We keep a map of who is where, built when removeData() or updateData()
+  // first need it: maintaining it costs a hash map entry per data, which
+  // misses the caches once the map outgrows them
+  std::unordered_map<typename TypeDescriptor<T>::const_pointer,
+                     SmartQuadtree<T>*> where;
+
+  // False while the map of who is where is not maintained
+  bool indexed;
+
+  // All leaves of the Quadtree, in order
+  std::list<SmartQuadtree<T>*> leaves;
+
+  // Storage for all quadrants but the root, by blocks of four siblings
+  BlockPool quadrants;
+
+  // Storage for the data of the leaves, by arrays of capacity elements
+  BlockPool buckets;
+
+  // Stamp of the current sweep of the (mutating) iterator
+  unsigned int epoch;
+
+  // Number of data in the tree
+  unsigned long size;
+
+  // Number of leaves per level and per size of their data lists, with the
+  // largest indices in use; bulk loads only count once built (recount())
+  std::vector<unsigned long> levels, sizes;
+  unsigned char depth;
+  std::size_t fullest;
+
+  Tree(SmartQuadtree<T>* root, unsigned int capacity) :
+    root(root), capacity(capacity), indexed(false),
+    quadrants(4 * sizeof(SmartQuadtree<T>)),
+    buckets(Storage::bytes(capacity > 0 ? capacity : 1)), epoch(0),
+    size(0), levels(1, 1), sizes(1, 1), depth(0), fullest(0) {}
+
+  // Counts n leaves more (less if negative) at level, holding data
+  void tally(unsigned char level, std::size_t data, long n)
+  {
+    if (levels.size() <= level) levels.resize(level + 1, 0);
+    if (sizes.size() <= data) sizes.resize(data + 1, 0);
+    levels[level] += n;
+    sizes[data] += n;
+    if (n > 0 && level > depth) depth = level;
+    if (n > 0 && data > fullest) fullest = data;
+    while (depth > 0 && levels[depth] == 0) --depth;
+    while (fullest > 0 && sizes[fullest] == 0) --fullest;
+  }
+
+  // Counts a leaf which held before data, and now holds after data
+  void resize(std::size_t before, std::size_t after)
+  {
+    if (sizes.size() <= after) sizes.resize(after + 1, 0);
+    --sizes[before];
+    ++sizes[after];
+    if (after > fullest) fullest = after;
+    while (fullest > 0 && sizes[fullest] == 0) --fullest;
+  }
+};
+
+template<class T>
+struct SmartQuadtree<T>::Rect
+{
+  float x0, x1, y0, y1;
+
+  Rect(const Boundary& box) :
+    x0(box.getX() - box.getDimX()), x1(box.getX() + box.getDimX()),
+    y0(box.getY() - box.getDimY()), y1(box.getY() + box.getDimY()) {}
+
+  // Quadrants hold data a bit beyond their borders (see Boundary::contains)
+  Coverage classify(const Boundary& b) const
+  {
+    float dx = b.getDimX() * 1.00001, dy = b.getDimY() * 1.00001;
+    if (b.getX() + dx < x0 || b.getX() - dx > x1 ||
+        b.getY() + dy < y0 || b.getY() - dy > y1)
+      return OUTSIDE;
+    if (b.getX() - dx >= x0 && b.getX() + dx <= x1 &&
+        b.getY() - dy >= y0 && b.getY() + dy <= y1)
+      return INSIDE;
+    return PARTIAL;
+  }
+
+  bool contains(float x, float y) const
+  { return (x >= x0 && x <= x1 && y >= y0 && y <= y1); }
+};
+
+template<class T>
+struct SmartQuadtree<T>::Circle
+{
+  float x, y, r2;
+
+  Circle(float x, float y, float r) : x(x), y(y), r2(r * r) {}
+
+  Coverage classify(const Boundary& b) const
+  {
+    float dx = b.getDimX() * 1.00001, dy = b.getDimY() * 1.00001;
+    float ax = std::abs(b.getX() - x), ay = std::abs(b.getY() - y);
+    // Closest and farthest points of the quadrant from the center
+    float nx = (ax > dx ? ax - dx : 0), ny = (ay > dy ? ay - dy : 0);
+    if (nx * nx + ny * ny >= r2) return OUTSIDE;
+    if ((ax + dx) * (ax + dx) + (ay + dy) * (ay + dy) < r2) return INSIDE;
+    return PARTIAL;
+  }
+
+  bool contains(float px, float py) const
+  { return ((px - x) * (px - x) + (py - y) * (py - y) < r2); }
+};
+
+template<class T>
+struct SmartQuadtree<T>::Corridor
+{
+  double x0, y0, dx, dy, r2;
+
+  Corridor(float x0, float y0, float x1, float y1, float r) :
+    x0(x0), y0(y0), dx(x1 - x0), dy(y1 - y0), r2(r * r) {}
+
+  // Narrows [t0, t1] to the part of the segment inside the box, enlarged
+  // by the tolerance of Boundary::contains; returns false if none is left
+  bool clip(const Boundary& b, double& t0, double& t1) const
+  {
+    double ex = b.getDimX() * 1.00001, ey = b.getDimY() * 1.00001;
+    double p[4] = { -dx, dx, -dy, dy };
+    double q[4] = { x0 - (b.getX() - ex), (b.getX() + ex) - x0,
+                    y0 - (b.getY() - ey), (b.getY() + ey) - y0 };
+    for (int i = 0; i < 4; ++i)
+    {
+      if (p[i] == 0) { if (q[i] < 0) return false; continue; }
+      double t = q[i] / p[i];
+      if (p[i] < 0) t0 = (t > t0 ? t : t0);
+      else t1 = (t < t1 ? t : t1);
+    }
+    return (t0 <= t1);
+  }
+
+  // Squared distance from (x, y) to the segment
+  double distance2(double x, double y) const
+  {
+    double len2 = dx * dx + dy * dy;
+    double t = (len2 > 0 ? ((x - x0) * dx + (y - y0) * dy) / len2 : 0);
+    t = (t < 0 ? 0 : (t > 1 ? 1 : t));
+    double ux = x0 + t * dx - x, uy = y0 + t * dy - y;
+    return ux * ux + uy * uy;
+  }
+
+  // Point of the box closest to the segment
+  void closest(const Boundary& b, double& x, double& y) const
+  {
+    double cx[6], cy[6];
+    for (int i = 0; i < 4; ++i)
+    {
+      cx[i] = b.getX() + (i & 1 ? b.getDimX() : -b.getDimX());
+      cy[i] = b.getY() + (i & 2 ? b.getDimY() : -b.getDimY());
+    }
+    // Ends of the segment clamped to the box
+    for (int i = 0; i < 2; ++i)
+    {
+      double ux = x0 + i * dx, uy = y0 + i * dy;
+      cx[4 + i] = std::min(std::max(ux, cx[0]), cx[1]);
+      cy[4 + i] = std::min(std::max(uy, cy[0]), cy[2]);
+    }
+    double best = distance2(cx[0], cy[0]);
+    x = cx[0]; y = cy[0];
+    for (int i = 1; i < 6; ++i)
+    {
+      double d2 = distance2(cx[i], cy[i]);
+      if (d2 < best) { best = d2; x = cx[i]; y = cy[i]; }
+    }
+  }
+
+  Coverage classify(const Boundary& b) const
+  {
+    double t0 = 0, t1 = 1, x, y;
+    if (r2 <= 0) return OUTSIDE;
+    if (!clip(b, t0, t1))
+    {
+      closest(Boundary(b.getX(), b.getY(), b.getDimX() * 1.00001,
+                       b.getDimY() * 1.00001), x, y);
+      if (distance2(x, y) >= r2) return OUTSIDE;
+    }
+    // The corridor is convex: the box is inside if its corners are
+    double ex = b.getDimX() * 1.00001, ey = b.getDimY() * 1.00001;
+    if (distance2(b.getX() - ex, b.getY() - ey) < r2 &&
+        distance2(b.getX() + ex, b.getY() - ey) < r2 &&
+        distance2(b.getX() - ex, b.getY() + ey) < r2 &&
+        distance2(b.getX() + ex, b.getY() + ey) < r2)
+      return INSIDE;
+    return PARTIAL;
+  }
+
+  bool contains(float x, float y) const { return (distance2(x, y) < r2); }
+};
+
+template<class T>
+struct SmartQuadtree<T>::Append
+{
+  std::vector<typename TypeDescriptor<T>::const_pointer>& out;
+
+  Append(std::vector<typename TypeDescriptor<T>::const_pointer>& out) :
+    out(out) {}
+
+  void operator()(typename TypeDescriptor<T>::const_pointer p)
+  { out.push_back(p); }
+};
+
+template<class T>
+struct SmartQuadtree<T>::Loader
+{
+  // Data and their location codes, sorted
+  const std::vector<T>& data;
+  const std::vector<std::pair<unsigned int, std::size_t> >& codes;
+
+  // Leaves of the subtree, in order
+  std::list<SmartQuadtree<T>*> leaves;
+
+  // Storage for the subtree, handed over to the tree afterwards
+  BlockPool quadrants;
+  BlockPool buckets;
+
+  // Data to be inserted once the tree is complete
+  std::vector<std::size_t> strays;
+
+  Loader(const std::vector<T>& data,
+         const std::vector<std::pair<unsigned int, std::size_t> >& codes,
+         const Tree& tree) :
+    data(data), codes(codes), quadrants(tree.quadrants.getChunkSize()),
+    buckets(tree.buckets.getChunkSize()) {}
+};
+
 template<class T>
 struct SmartQuadtree<T>::const_iterator
 : std::iterator < std::input_iterator_tag, const T >
@@ -364,17 +1390,21 @@ struct SmartQuadtree<T>::const_iterator
 private:
 
   typename std::list<SmartQuadtree<T>*>::const_iterator leafIterator, leafEnd;
-  typename std::list<T>::const_iterator it, itEnd;
+  typename Storage::const_iterator it, itEnd;
   std::vector<typename TypeDescriptor<T>::const_pointer>
     forward_cells_neighbours;
   typename
     std::vector<typename TypeDescriptor<T>::const_pointer>::const_iterator
     forward_cells_begin;
 
-  // Current leaf: number of covered summits
+  // Current leaf: 4 if inside the mask
   unsigned char aux;
   // NULL if no mask
   PolygonMask* polygonmask;
+  // Largest subtree inside the mask around the current leaf (or NULL)
+  const SmartQuadtree<T>* inside;
+  // Subtrees outside the mask may be skipped (leafEnd ends the list)
+  bool prune;
   // forward_cells_neighbours computed for current cell
   bool neighbours_computed;
 
@@ -383,6 +1413,16 @@ private:
 };
 
 
+/*
+ * The iterator checks, when moving to the next element, whether the current
+ * element has left its cell, and inserts it again from the root if needed.
+ *
+ * A moved element may land in a leaf not parsed yet: it is stamped with the
+ * epoch of the sweep (each begin() starts a new one) so that it is not
+ * yielded twice. The check is a comparison with the stamp stored next to the
+ * element: a full sweep over n elements, m of which change cells, costs
+ * O(n + m.d) where d is the depth of the quadtree, however large m is.
+ */
 template<class T>
 struct SmartQuadtree<T>::iterator
 : std::iterator < std::input_iterator_tag, T >
@@ -405,15 +1445,19 @@ struct SmartQuadtree<T>::iterator
 private:
 
   typename std::list<SmartQuadtree<T>*>::iterator leafIterator, leafEnd;
-  typename std::list<T>::iterator it, itEnd;
+  typename Storage::iterator it, itEnd;
 
-  // Elements already parsed
-  std::vector<typename TypeDescriptor<T>::const_pointer> already;
+  // Stamp of elements already parsed during this sweep
+  unsigned int epoch;
 
-  // Current leaf: number of covered summits
+  // Current leaf: 4 if inside the mask
   unsigned char aux;
   // NULL if no mask
   PolygonMask* polygonmask;
+  // Largest subtree inside the mask around the current leaf (or NULL)
+  const SmartQuadtree<T>* inside;
+  // Subtrees outside the mask may be skipped (leafEnd ends the list)
+  bool prune;
 
   void advanceToNextLeaf();
 
@@ -433,6 +1477,16 @@ public:
   typename SmartQuadtree<T>::const_iterator begin() const;
   typename SmartQuadtree<T>::const_iterator end() const;
 
+  //! See SmartQuadtree::forEachNeighbourPair
+  template<typename Function>
+  void forEachNeighbourPair(Function fn, unsigned int threads = 0) const
+  { quadtree.visit(fn, threads, polygonmask); }
+
+  //! See SmartQuadtree::pairsWithin
+  template<typename Function>
+  void pairsWithin(float radius, Function fn, unsigned int threads = 0) const
+  { quadtree.visit(fn, threads, polygonmask, radius); }
+
 private:
   SmartQuadtree<T>& quadtree;
   PolygonMask* polygonmask;
@@ -6,11 +6,124 @@
  * Xavier Olive, 28 nov. 2014
  */
 
+#include <new>
 #include <vector>
 #include <algorithm>
+#include <functional>
+#include <limits>
+#include <thread>
 
 using std::list;
 
+template<typename T>
+std::size_t Bucket<T>::pooled(const BlockPool& pool)
+{
+  std::size_t r = pool.getChunkSize() / (sizeof(T) + sizeof(unsigned int));
+  while (bytes(r + 1) <= pool.getChunkSize()) ++r;
+  return r;
+}
+
+template<typename T>
+bool Bucket<T>::push_back(const T& elt, unsigned int stamp, BlockPool& pool)
+{
+  bool moved = false;
+  if (count == room)
+  {
+    // The first array comes from the pool, larger ones from the heap
+    std::size_t fromPool = pooled(pool);
+    std::size_t newroom = (0 == room ? fromPool : 2 * room);
+    Bucket<T> larger;
+    larger.data = static_cast<T*>(0 == room ? pool.allocate() :
+                                  ::operator new(bytes(newroom)));
+    larger.room = newroom;
+    for (unsigned int i = 0; i < count; ++i)
+    {
+      new (larger.data + i) T(data[i]);
+      larger.stamps()[i] = stamps()[i];
+    }
+    larger.count = count;
+    swap(larger);
+    larger.clear(pool);
+    moved = (count > 0);
+  }
+  new (data + count) T(elt);
+  stamps()[count] = stamp;
+  ++count;
+  return moved;
+}
+
+template<typename T>
+typename Bucket<T>::Moving Bucket<T>::take(iterator pos, BlockPool&)
+{
+  assert(pos >= data && pos < data + count);
+  Moving m(*pos, stamp(pos));
+  if (pos != data + count - 1)
+  {
+    std::swap(*pos, data[count - 1]);
+    stamps()[pos - data] = stamps()[count - 1];
+  }
+  data[--count].~T();
+  return m;
+}
+
+template<typename T>
+void Bucket<T>::clear(BlockPool& pool)
+{
+  for (unsigned int i = 0; i < count; ++i) data[i].~T();
+  if (NULL != data)
+  {
+    if (room == pooled(pool)) pool.release(data);
+    else ::operator delete(data);
+  }
+  data = NULL;
+  count = 0;
+  room = 0;
+}
+
+template<typename T>
+void Bucket<T>::swap(Bucket<T>& other)
+{
+  std::swap(data, other.data);
+  std::swap(count, other.count);
+  std::swap(room, other.room);
+}
+
+template<typename T>
+typename NodeBucket<T>::iterator NodeBucket<T>::at(const T* p)
+{
+  for (std::size_t i = 0; i < nodes.size(); ++i)
+    if (&nodes[i]->data == p) return iterator(nodes.data() + i);
+  return end();
+}
+
+template<typename T>
+typename NodeBucket<T>::Moving NodeBucket<T>::take(iterator pos, BlockPool&)
+{
+  Node* const* slot = pos.base();
+  assert(slot >= nodes.data() && slot < nodes.data() + nodes.size());
+  Node* node = *slot;
+  nodes[slot - nodes.data()] = nodes.back();
+  nodes.pop_back();
+  return node;
+}
+
+template<typename T>
+typename NodeBucket<T>::Moving NodeBucket<T>::release(iterator pos)
+{
+  Node* node = *pos.base();
+  nodes[pos.base() - nodes.data()] = NULL;
+  return node;
+}
+
+template<typename T>
+void NodeBucket<T>::clear(BlockPool& pool)
+{
+  // Slots of released elements are empty
+  for (std::size_t i = 0; i < nodes.size(); ++i)
+    if (NULL != nodes[i]) drop(nodes[i], pool);
+  std::vector<Node*>().swap(nodes);
+}
+
 template<typename T>
 const unsigned char SmartQuadtree<T>::diags[] =
 { SOUTHWEST, SOUTHEAST, NORTHWEST, NORTHEAST };
@@ -27,39 +140,306 @@ template<typename T>
 SmartQuadtree<T>* SmartQuadtree<T>::getQuadrant(unsigned long location,
                                                 unsigned short depth) const
 {
-  assert(depth < 2048);
-  SmartQuadtree *quadrant = ancestor, *desc;
-  static unsigned char stack[2048];
-  short istack = depth - 1;
+  assert(2 * depth <= 8 * sizeof(location));
+  SmartQuadtree *quadrant = tree->root;
 
-  for (unsigned short i = 0; i < depth; i++, location >>= 2)
-    stack[i] = location & 3;
-  for (unsigned short i = 0; i < depth; i++)
+  // Children indices are read from the most significant pair of bits
+  for (unsigned short shift = 2 * depth; shift > 0; shift -= 2)
   {
-    desc = quadrant->children[stack[istack]];
-    if (NULL == desc)
+    if (NULL == quadrant->children)
       return quadrant;
-    quadrant = desc;
-    istack --;
+    quadrant = quadrant->children + ((location >> (shift - 2)) & 3);
   }
 
   return quadrant;
 }
 
+template<typename T>
+Coverage SmartQuadtree<T>::coverage(const PolygonMask& mask) const
+{
+  // Threads visiting pairs may check the same leaf: the race is harmless as
+  // they all store the same value
+  unsigned long cached = covered.load(std::memory_order_relaxed);
+  if ((cached >> 2) == mask.getId()) return Coverage(cached & 3);
+
+  Coverage c = mask.classify(b);
+  covered.store((mask.getId() << 2) | c, std::memory_order_relaxed);
+  return c;
+}
+
+template<typename T>
+template<typename LeafIterator>
+Coverage SmartQuadtree<T>::enter(LeafIterator& leaf, const LeafIterator& end,
+                                 const PolygonMask& mask,
+                                 const SmartQuadtree<T>*& inside)
+{
+  while (leaf != end)
+  {
+    if (inside != NULL && inside->ancestorOf(*leaf)) return INSIDE;
+
+    // Children replace their parent in the list as 3, 2, 1, 0: leaf is the
+    // first leaf of all ancestors up from it through children 3
+    const SmartQuadtree<T>* node = *leaf;
+    while (node->parent != NULL && node == node->parent->children + 3)
+      node = node->parent;
+
+    // From the top down, the largest of them not partially covered
+    Coverage c;
+    while ((c = node->coverage(mask)) == PARTIAL && node->children != NULL)
+      node = node->children + 3;
+    if (c == PARTIAL) return PARTIAL;
+    if (c == INSIDE)
+    {
+      inside = node;
+      return INSIDE;
+    }
+
+    // The last leaf of the subtree is down through children 0
+    while (node->children != NULL) node = node->children;
+    leaf = node->leaf;
+    ++leaf;
+  }
+  return OUTSIDE;
+}
+
+template<typename T>
+void SmartQuadtree<T>::collect(const PolygonMask& mask,
+                               std::vector<const SmartQuadtree<T>*>& leaves,
+                               bool inside) const
+{
+  if (inside)
+    covered.store((mask.getId() << 2) | INSIDE, std::memory_order_relaxed);
+  else
+  {
+    Coverage c = coverage(mask);
+    if (c == OUTSIDE) return;
+    inside = (c == INSIDE);
+  }
+
+  if (children == NULL) leaves.push_back(this);
+  else
+    for (int i = 3; i >= 0; --i) children[i].collect(mask, leaves, inside);
+}
+
+template<typename T>
+template<typename Shape, typename Function>
+void SmartQuadtree<T>::query(const Shape& shape, Function& fn,
+                             bool inside) const
+{
+  if (!inside)
+  {
+    Coverage c = shape.classify(b);
+    if (c == OUTSIDE) return;
+    inside = (c == INSIDE);
+  }
+
+  typename Storage::const_iterator it = points.begin(), ie = points.end();
+  for ( ; it != ie; ++it)
+    if (inside ||
+        shape.contains(BoundaryXY<T>::getX(*it), BoundaryXY<T>::getY(*it)))
+      fn(TypeDescriptor<T>::getPtr(*it));
+
+  if (children != NULL)
+    for (int i = 0; i < 4; ++i) children[i].query(shape, fn, inside);
+}
+
+template<typename T>
+const SmartQuadtree<T>* SmartQuadtree<T>::locate(double x, double y,
+                                                 double dx, double dy) const
+{
+  const SmartQuadtree<T>* node = this;
+  while (node->children != NULL)
+  {
+    const Boundary& nb = node->b;
+    bool east = (x > nb.center_x || (x == nb.center_x && dx > 0));
+    bool north = (y > nb.center_y || (y == nb.center_y && dy > 0));
+    node = node->children + (east ? 1 : 0) + (north ? 2 : 0);
+  }
+  return node;
+}
+
+template<typename T>
+template<typename Function>
+void SmartQuadtree<T>::crossed(const Corridor& corridor, Function& fn) const
+{
+  double t = 0, end = 1;
+  if (!corridor.clip(b, t, end)) return;
+
+  double dx = corridor.dx, dy = corridor.dy;
+  const SmartQuadtree<T>* node =
+    locate(corridor.x0 + t * dx, corridor.y0 + t * dy, dx, dy);
+
+  // Each step enters a leaf further along: the bound only guards against
+  // rounding errors
+  for (std::size_t steps = tree->leaves.size(); steps > 0; --steps)
+  {
+    fn(node);
+
+    // Where the segment leaves the quadrant
+    const Boundary& nb = node->b;
+    double tx = std::numeric_limits<double>::max(), ty = tx;
+    if (dx != 0)
+      tx = (nb.center_x + (dx > 0 ? nb.dim_x : -nb.dim_x) - corridor.x0) / dx;
+    if (dy != 0)
+      ty = (nb.center_y + (dy > 0 ? nb.dim_y : -nb.dim_y) - corridor.y0) / dy;
+    double out = std::min(tx, ty);
+    if (out >= end) return;
+
+    // Neighbour of same level or larger, or the subtree in its place
+    unsigned char dir = (tx <= ty ? (dx > 0 ? EAST : WEST) :
+                         (dy > 0 ? NORTH : SOUTH));
+    const SmartQuadtree<T>* next = node->samelevel(dir);
+    if (next == NULL) return;
+    t = std::max(t, out);
+    if (node->delta[dir] > 0)
+      next = next->locate(corridor.x0 + t * dx, corridor.y0 + t * dy, dx, dy);
+    node = next;
+  }
+}
+
+template<typename T>
+float SmartQuadtree<T>::distance2(float x, float y) const
+{
+  // Quadrants hold data a bit beyond their borders (see Boundary::contains)
+  float dx = std::abs(b.center_x - x) - b.dim_x * 1.00001;
+  float dy = std::abs(b.center_y - y) - b.dim_y * 1.00001;
+  dx = (dx > 0 ? dx : 0);
+  dy = (dy > 0 ? dy : 0);
+  return dx * dx + dy * dy;
+}
+
+template<typename T>
+void SmartQuadtree<T>::search(float x, float y, std::size_t k,
+                              Nearest& nearest) const
+{
+  typedef std::pair<float, const SmartQuadtree<T>*> Quadrant;
+  std::vector<Quadrant>& queue = nearest.queue;
+  std::vector<std::pair<float, typename TypeDescriptor<T>::const_pointer> >&
+    best = nearest.best;
+  std::greater<Quadrant> farther;
+
+  std::make_heap(best.begin(), best.end());
+  queue.clear();
+  queue.push_back(Quadrant(distance2(x, y), this));
+
+  while (!queue.empty())
+  {
+    std::pop_heap(queue.begin(), queue.end(), farther);
+    Quadrant next = queue.back();
+    queue.pop_back();
+    if (best.size() == k && next.first >= best.front().first) break;
+
+    const SmartQuadtree<T>* node = next.second;
+    typename Storage::const_iterator it = node->points.begin();
+    typename Storage::const_iterator ie = node->points.end();
+    for ( ; it != ie; ++it)
+    {
+      float dx = BoundaryXY<T>::getX(*it) - x;
+      float dy = BoundaryXY<T>::getY(*it) - y;
+      float d2 = dx * dx + dy * dy;
+      if (best.size() == k && d2 >= best.front().first) continue;
+      typename TypeDescriptor<T>::const_pointer p =
+        TypeDescriptor<T>::getPtr(*it);
+      if (std::find(nearest.seeds.begin(), nearest.seeds.end(), p) !=
+          nearest.seeds.end())
+        continue;
+      if (best.size() == k)
+      {
+        std::pop_heap(best.begin(), best.end());
+        best.pop_back();
+      }
+      best.push_back(std::make_pair(d2, p));
+      std::push_heap(best.begin(), best.end());
+    }
+
+    if (node->children == NULL) continue;
+    for (int i = 0; i < 4; ++i)
+    {
+      float d2 = node->children[i].distance2(x, y);
+      if (best.size() == k && d2 >= best.front().first) continue;
+      queue.push_back(Quadrant(d2, node->children + i));
+      std::push_heap(queue.begin(), queue.end(), farther);
+    }
+  }
+
+  std::sort_heap(best.begin(), best.end());
+}
+
+template<typename T>
+void SmartQuadtree<T>::nearest(
+  float x, float y, std::size_t k,
+  std::vector<typename TypeDescriptor<T>::const_pointer>& out) const
+{
+  out.clear();
+  if (k == 0) return;
+  Nearest nearest;
+  search(x, y, k, nearest);
+  for (std::size_t i = 0; i < nearest.best.size(); ++i)
+    out.push_back(nearest.best[i].second);
+}
+
+template<typename T>
+void SmartQuadtree<T>::nearest(
+  const float* x, const float* y, std::size_t n, std::size_t k,
+  std::vector<typename TypeDescriptor<T>::const_pointer>& out) const
+{
+  out.assign(n * k, NULL);
+  if (k == 0) return;
+
+  // Close positions follow each other in the order of location codes
+  std::vector<std::pair<unsigned int, std::size_t> > codes(n);
+  for (std::size_t i = 0; i < n; ++i)
+    codes[i] = std::make_pair(code(x[i], y[i]), i);
+  Neighbour::sort(codes);
+
+  Nearest nearest;
+  for (std::size_t j = 0; j < n; ++j)
+  {
+    std::size_t i = codes[j].second;
+
+    // The answer to the previous position bounds the search from the start
+    nearest.seeds.clear();
+    for (std::size_t s = 0; s < nearest.best.size(); ++s)
+    {
+      typename TypeDescriptor<T>::const_pointer p = nearest.best[s].second;
+      float dx = BoundaryXY<T>::getX(*p) - x[i];
+      float dy = BoundaryXY<T>::getY(*p) - y[i];
+      nearest.best[s].first = dx * dx + dy * dy;
+      nearest.seeds.push_back(p);
+    }
+
+    search(x[i], y[i], k, nearest);
+    for (std::size_t s = 0; s < nearest.best.size(); ++s)
+      out[i * k + s] = nearest.best[s].second;
+  }
+}
+
+template<typename T>
+unsigned int SmartQuadtree<T>::code(double x, double y) const
+{
+  const double side = 1 << Neighbour::codelevels;
+  x = (x - b.center_x + b.dim_x) / (2. * b.dim_x) * side;
+  y = (y - b.center_y + b.dim_y) / (2. * b.dim_y) * side;
+  x = (x < 0 ? 0 : (x < side - 1 ? x : side - 1));
+  y = (y < 0 ? 0 : (y < side - 1 ? y : side - 1));
+  return Neighbour::interleave(static_cast<unsigned int>(x),
+                               static_cast<unsigned int>(y));
+}
+
 template<typename T>
 SmartQuadtree<T>::SmartQuadtree(const SmartQuadtree<T>& e,
                                 unsigned char subdivision,
+                                list<SmartQuadtree<T>*>& leaves,
                                 typename list<SmartQuadtree<T>*>::iterator& w)
-: b(e.b), capacity(e.capacity)
+: b(e.b), children(NULL), parent(const_cast<SmartQuadtree<T>*>(&e)),
+  tree(e.tree), covered(0)
 {
 
-  for (int i = 0; i<4; ++i) children[i] = NULL;
-
   location = (e.location << 2) + subdivision;
   level    = e.level + 1;
-  ancestor = e.ancestor;
 
-  w = ancestor->leaves.insert(w, this);
+  w = leaves.insert(w, this);
+  leaf = w;
 
   if (subdivision > 1) // north
     b.center_y = e.b.center_y + e.b.dim_y / 2.;
@@ -88,55 +468,294 @@ SmartQuadtree<T>::SmartQuadtree(const SmartQuadtree<T>& e,
 
 }
 
+template<typename T>
+template<typename InputIterator>
+SmartQuadtree<T>::SmartQuadtree(float center_x, float center_y,
+                                float dim_x, float dim_y,
+                                unsigned int capacity,
+                                InputIterator first, InputIterator last,
+                                unsigned int threads) :
+  b(center_x, center_y, dim_x, dim_y), location(0), level(0),
+  children(NULL), parent(NULL), tree(new Tree(this, capacity)), covered(0)
+{
+  delta[0] = 2; delta[1] = 2; delta[2] = 2; delta[3] = 2;
+  delta[4] = 2; delta[5] = 2; delta[6] = 2; delta[7] = 2;
+  leaf = tree->leaves.insert(tree->leaves.end(), this);
+  tree->indexed = false;
+
+  std::vector<T> data(first, last);
+
+  if (threads == 0) threads = std::thread::hardware_concurrency();
+  if (threads == 0) threads = 1;
+
+  // Location codes at the deepest level codes can hold, each thread taking
+  // a slice of the data; slices are put back in order
+  std::vector<std::vector<std::pair<unsigned int, std::size_t> > >
+    slices(threads);
+  std::vector<std::thread> workers;
+  for (unsigned int i = 1; i < threads; ++i)
+    workers.push_back(std::thread(&SmartQuadtree<T>::encode, this,
+                                  std::cref(data), i * data.size() / threads,
+                                  (i + 1) * data.size() / threads,
+                                  std::ref(slices[i])));
+  encode(data, 0, data.size() / threads, slices[0]);
+  for (std::size_t i = 0; i < workers.size(); ++i) workers[i].join();
+
+  std::vector<std::pair<unsigned int, std::size_t> > codes;
+  codes.swap(slices[0]);
+  for (unsigned int i = 1; i < threads; ++i)
+  {
+    codes.insert(codes.end(), slices[i].begin(), slices[i].end());
+    std::vector<std::pair<unsigned int, std::size_t> >().swap(slices[i]);
+  }
+  Neighbour::sort(codes, threads);
+
+  // Top levels are built first, until there are enough subtrees to share
+  // between threads
+  unsigned char split = 0;
+  while (threads > 1 && (1u << (2 * split)) < 16 * threads &&
+         split < Neighbour::codelevels)
+    ++split;
+
+  // Each part of the tree is built in its own list of leaves, then put back
+  // in place of its root, marked by a NULL entry
+  std::vector<Loader*> loaders(1, new Loader(data, codes, *tree));
+  typename list<SmartQuadtree<T>*>::iterator hole =
+    tree->leaves.insert(leaf, NULL);
+  loaders[0]->leaves.splice(loaders[0]->leaves.end(), tree->leaves, leaf);
+
+  std::vector<SmartQuadtree<T>*> tasks;
+  std::vector<typename list<SmartQuadtree<T>*>::iterator> holes;
+  bulk(*loaders[0], 0, codes.size(), split, tasks);
+  for (std::size_t i = 0; i < tasks.size(); ++i)
+  {
+    loaders.push_back(new Loader(data, codes, *tree));
+    holes.push_back(loaders[0]->leaves.insert(tasks[i]->leaf, NULL));
+    loaders.back()->leaves.splice(loaders.back()->leaves.end(),
+                                  loaders[0]->leaves, tasks[i]->leaf);
+  }
+
+  std::atomic<std::size_t> next(0);
+  workers.clear();
+  for (unsigned int i = 1; i < threads && i < tasks.size(); ++i)
+    workers.push_back(std::thread(work, std::cref(tasks),
+                                  std::cref(loaders), std::ref(next)));
+  work(tasks, loaders, next);
+  for (std::size_t i = 0; i < workers.size(); ++i) workers[i].join();
+
+  std::vector<std::size_t> strays;
+  for (std::size_t i = 0; i < loaders.size(); ++i)
+  {
+    if (i > 0)
+    {
+      loaders[0]->leaves.splice(holes[i - 1], loaders[i]->leaves);
+      loaders[0]->leaves.erase(holes[i - 1]);
+    }
+    tree->quadrants.adopt(loaders[i]->quadrants);
+    tree->buckets.adopt(loaders[i]->buckets);
+    strays.insert(strays.end(),
+                  loaders[i]->strays.begin(), loaders[i]->strays.end());
+  }
+  tree->leaves.splice(hole, loaders[0]->leaves);
+  tree->leaves.erase(hole);
+  for (std::size_t i = 0; i < loaders.size(); ++i) delete loaders[i];
+
+  // The structure is complete: deltas of the subtrees are computed by the
+  // same threads, the top levels first
+  computeDeltas(split);
+  next = 0;
+  workers.clear();
+  for (unsigned int i = 1; i < threads && i < tasks.size(); ++i)
+    workers.push_back(std::thread(
+        static_cast<void (*)(const std::vector<SmartQuadtree<T>*>&,
+                             std::atomic<std::size_t>&)>(computeDeltas),
+        std::cref(tasks), std::ref(next)));
+  computeDeltas(tasks, next);
+  for (std::size_t i = 0; i < workers.size(); ++i) workers[i].join();
+  recount();
+
+  // Data on the border of two quadrants, or in deeper levels
+  for (std::size_t i = 0; i < strays.size(); ++i) insert(data[strays[i]]);
+}
+
+template<typename T>
+void SmartQuadtree<T>::encode(
+    const std::vector<T>& data, std::size_t first, std::size_t last,
+    std::vector<std::pair<unsigned int, std::size_t> >& codes)
+{
+  codes.reserve(last - first);
+  for (std::size_t i = first; i < last; ++i)
+  {
+    if (!b.contains(data[i])) continue;
+    codes.push_back(std::make_pair(code(BoundaryXY<T>::getX(data[i]),
+                                        BoundaryXY<T>::getY(data[i])), i));
+  }
+}
+
+template<typename T>
+void SmartQuadtree<T>::work(const std::vector<SmartQuadtree<T>*>& tasks,
+                            const std::vector<Loader*>& loaders,
+                            std::atomic<std::size_t>& next)
+{
+  std::vector<SmartQuadtree<T>*> none;
+  for (std::size_t i = next++; i < tasks.size(); i = next++)
+  {
+    SmartQuadtree<T>* node = tasks[i];
+    Loader& loader = *loaders[i + 1];
+
+    // Range of codes starting with the location code of the quadrant
+    const unsigned int shift = 2 * (Neighbour::codelevels - node->level);
+    unsigned long long start = (unsigned long long) node->location << shift;
+    unsigned long long end = start + (1ull << shift);
+    std::size_t first = std::lower_bound(
+        loader.codes.begin(), loader.codes.end(),
+        std::make_pair(static_cast<unsigned int>(start), std::size_t(0))) -
+      loader.codes.begin();
+    std::size_t last = (end >> 32 ? loader.codes.size() : std::lower_bound(
+        loader.codes.begin() + first, loader.codes.end(),
+        std::make_pair(static_cast<unsigned int>(end), std::size_t(0))) -
+      loader.codes.begin());
+
+    node->bulk(loader, first, last, Neighbour::codelevels + 1, none);
+  }
+}
+
+template<typename T>
+void SmartQuadtree<T>::bulk(Loader& loader,
+                            std::size_t first, std::size_t last,
+                            unsigned char stop,
+                            std::vector<SmartQuadtree<T>*>& tasks)
+{
+  const std::vector<T>& data = loader.data;
+  const std::vector<std::pair<unsigned int, std::size_t> >& codes =
+    loader.codes;
+
+  if (b.limit || last - first <= tree->capacity)
+  {
+    for (std::size_t i = first; i < last; ++i)
+      // Rounding errors may misplace data on the border of the quadrant
+      if (b.contains(data[codes[i].second]))
+        points.push_back(data[codes[i].second], 0, loader.buckets);
+      else
+        loader.strays.push_back(codes[i].second);
+    return;
+  }
+
+  // Splitting further is left to insert()
+  if (level == Neighbour::codelevels)
+  {
+    for (std::size_t i = first; i < last; ++i)
+      loader.strays.push_back(codes[i].second);
+    return;
+  }
+
+  if (level == stop)
+  {
+    tasks.push_back(this);
+    return;
+  }
+
+  subdivide(loader.leaves, loader.quadrants);
+
+  // Codes of each child are contiguous, children are in location order
+  const unsigned int shift = 2 * (Neighbour::codelevels - level - 1);
+  for (unsigned char i = 0; i < 3; ++i)
+  {
+    unsigned int next = static_cast<unsigned int>(((location << 2) + i + 1)
+                                                  << shift);
+    std::size_t middle =
+      std::lower_bound(codes.begin() + first, codes.begin() + last,
+                       std::make_pair(next, std::size_t(0))) - codes.begin();
+    children[i].bulk(loader, first, middle, stop, tasks);
+    first = middle;
+  }
+  children[3].bulk(loader, first, last, stop, tasks);
+}
+
+template<typename T>
+void SmartQuadtree<T>::computeDeltas(unsigned char stop)
+{
+  for (unsigned char i = 0; i < 8; ++i) delta[i] = computeDelta(i);
+  if (NULL == children || level >= stop) return;
+  for (unsigned char i = 0; i < 4; ++i) children[i].computeDeltas(stop);
+}
+
+template<typename T>
+void SmartQuadtree<T>::computeDeltas(
+    const std::vector<SmartQuadtree<T>*>& tasks,
+    std::atomic<std::size_t>& next)
+{
+  for (std::size_t i = next++; i < tasks.size(); i = next++)
+    tasks[i]->computeDeltas();
+}
+
 template<typename T>
 SmartQuadtree<T>::~SmartQuadtree()
 {
-  if (NULL == children[0]) return;
-  delete children[0]; delete children[1];
-  delete children[2]; delete children[3];
+  if (NULL != children)
+  {
+    children[0].~SmartQuadtree(); children[1].~SmartQuadtree();
+    children[2].~SmartQuadtree(); children[3].~SmartQuadtree();
+    tree->quadrants.release(children);
+  }
+  points.clear(tree->buckets);
+  if (this == tree->root) delete tree;
 }
 
 template<typename T>
 typename SmartQuadtree<T>::const_iterator SmartQuadtree<T>::begin() const
-{ return SmartQuadtree<T>::const_iterator(leaves.begin(), leaves.end()); }
+{
+  return SmartQuadtree<T>::const_iterator(tree->leaves.begin(),
+                                          tree->leaves.end());
+}
 
 template<typename T>
 typename SmartQuadtree<T>::const_iterator SmartQuadtree<T>::end() const
-{ return SmartQuadtree<T>::const_iterator(leaves.end(), leaves.end()); }
+{
+  return SmartQuadtree<T>::const_iterator(tree->leaves.end(),
+                                          tree->leaves.end());
+}
 
 template<typename T>
 typename SmartQuadtree<T>::iterator SmartQuadtree<T>::begin()
-{ return SmartQuadtree<T>::iterator(leaves.begin(), leaves.end()); }
+{
+  return SmartQuadtree<T>::iterator(tree->leaves.begin(),
+                                    tree->leaves.end());
+}
 
 template<typename T>
 typename SmartQuadtree<T>::iterator SmartQuadtree<T>::end()
-{ return SmartQuadtree<T>::iterator(leaves.end(), leaves.end()); }
+{
+  return SmartQuadtree<T>::iterator(tree->leaves.end(),
+                                    tree->leaves.end());
+}
 
 template<typename T>
 typename TypeDescriptor<T>::const_pointer SmartQuadtree<T>::insert(T pt)
 {
   if (!b.contains(pt)) return NULL;
+  typename Storage::Moving m = Storage::make(pt, 0, tree->buckets);
+  typename TypeDescriptor<T>::const_pointer ptr = insert(m);
+  if (NULL != ptr) ++tree->size;
+  else Storage::drop(m, tree->buckets);
+  return ptr;
+}
+
+template<typename T>
+typename TypeDescriptor<T>::const_pointer
+SmartQuadtree<T>::insert(typename Storage::Moving& pt)
+{
+  if (!b.contains(Storage::value(pt))) return NULL;
 
   // It is OK to go over capacity if a test "limitation" on b is verified
-  if (b.limit || ((NULL == children[0]) && (points.size() < capacity)))
-  {
-    points.push_back(pt);
-    ancestor->where[TypeDescriptor<T>::getPtr(points.back())] = this;
-    return TypeDescriptor<T>::getPtr(points.back());
-  }
+  if (b.limit || ((NULL == children) && (points.size() < tree->capacity)))
+    return attach(pt);
 
-  if (NULL == children[0])
+  if (NULL == children)
   {
-    typename list<SmartQuadtree<T>*>::iterator w =
-      std::find(ancestor->leaves.begin(), ancestor->leaves.end(), this);
-
-    assert(w != ancestor->leaves.end());
-    w = ancestor->leaves.erase(w);
-
-    children[0] = new SmartQuadtree(*this, 0, w);
-    children[1] = new SmartQuadtree(*this, 1, w);
-    children[2] = new SmartQuadtree(*this, 2, w);
-    children[3] = new SmartQuadtree(*this, 3, w);
+    subdivide(tree->leaves, tree->quadrants);
+    tree->tally(level, points.size(), -1);
+    tree->tally(level + 1, 0, 4);
 
     // Update neighbour info
     for (unsigned int i = 0; i < 8; ++i)
@@ -145,38 +764,64 @@ typename TypeDescriptor<T>::const_pointer SmartQuadtree<T>::insert(T pt)
           updateDelta(i);
 
     // Forward data to children
-    //std::for_each (points.begin(), points.end(),
-    //               [=](void* p) { this->insert(p); } );
-    for (typename list<T>::iterator it = points.begin();
-        it != points.end(); ++it)
+    Storage forward;
+    forward.swap(points);
+    for (typename Storage::iterator it = forward.begin();
+        it != forward.end(); ++it)
     {
-//       ancestor->where.erase(TypeDescriptor<T>::getPtr(*it));
-      this->insert(*it);
+      if (tree->indexed) tree->where.erase(TypeDescriptor<T>::getPtr(*it));
+      typename Storage::Moving m = forward.release(it);
+      if (NULL != this->insert(m)) continue;
+      // Children have a smaller tolerance (see Boundary::contains): data on
+      // the border belong to a neighbour, found from the parent; data out
+      // of the root are lost
+      if (NULL != parent) parent->reinsert(m);
+      else
+      {
+        Storage::drop(m, tree->buckets);
+        --tree->size;
+      }
     }
-    points.clear();
+    forward.clear(tree->buckets);
   }
 
-  typename TypeDescriptor<T>::const_pointer ptr0(children[0]->insert(pt));
+  typename TypeDescriptor<T>::const_pointer ptr0(children[0].insert(pt));
   if (ptr0 != NULL) return ptr0;
 
-  typename TypeDescriptor<T>::const_pointer ptr1(children[1]->insert(pt));
+  typename TypeDescriptor<T>::const_pointer ptr1(children[1].insert(pt));
   if (ptr1 != NULL) return ptr1;
 
-  typename TypeDescriptor<T>::const_pointer ptr2(children[2]->insert(pt));
+  typename TypeDescriptor<T>::const_pointer ptr2(children[2].insert(pt));
   if (ptr2 != NULL) return ptr2;
 
-  typename TypeDescriptor<T>::const_pointer ptr3(children[3]->insert(pt));
+  typename TypeDescriptor<T>::const_pointer ptr3(children[3].insert(pt));
   if (ptr3 != NULL) return ptr3;
 
   return NULL;
 
 }
 
+template<typename T>
+void SmartQuadtree<T>::subdivide(list<SmartQuadtree<T>*>& leaves,
+                                 BlockPool& quadrants)
+{
+  typename list<SmartQuadtree<T>*>::iterator w = leaves.erase(leaf);
+
+  // The four siblings are built in place in one chunk of the pool
+  SmartQuadtree<T>* quad =
+    static_cast<SmartQuadtree<T>*>(quadrants.allocate());
+  new (quad + 0) SmartQuadtree(*this, 0, leaves, w);
+  new (quad + 1) SmartQuadtree(*this, 1, leaves, w);
+  new (quad + 2) SmartQuadtree(*this, 2, leaves, w);
+  new (quad + 3) SmartQuadtree(*this, 3, leaves, w);
+  children = quad;
+}
+
 template<typename T>
 void SmartQuadtree<T>::updateDiagonal(unsigned char diagdir,
                                       unsigned char dir, int d)
 {
-  if (children[0] == NULL)
+  if (children == NULL)
   {
     assert(delta[diagdir] == 3);
     delta[diagdir] = d;
@@ -187,30 +832,30 @@ void SmartQuadtree<T>::updateDiagonal(unsigned char diagdir,
   if (dir == WEST)
   {
     if (diagdir == NORTHWEST)
-      children[2]->updateDiagonal(diagdir, dir, d-1);
+      children[2].updateDiagonal(diagdir, dir, d-1);
     else
-      children[0]->updateDiagonal(diagdir, dir, d-1);
+      children[0].updateDiagonal(diagdir, dir, d-1);
   }
   if (dir == SOUTH)
   {
     if (diagdir == SOUTHEAST)
-      children[1]->updateDiagonal(diagdir, dir, d-1);
+      children[1].updateDiagonal(diagdir, dir, d-1);
     else
-      children[0]->updateDiagonal(diagdir, dir, d-1);
+      children[0].updateDiagonal(diagdir, dir, d-1);
   }
   if (dir == EAST)
   {
     if (diagdir == NORTHEAST)
-      children[3]->updateDiagonal(diagdir, dir, d-1);
+      children[3].updateDiagonal(diagdir, dir, d-1);
     else
-      children[1]->updateDiagonal(diagdir, dir, d-1);
+      children[1].updateDiagonal(diagdir, dir, d-1);
   }
   if (dir == NORTH)
   {
     if (diagdir == NORTHEAST)
-      children[3]->updateDiagonal(diagdir, dir, d-1);
+      children[3].updateDiagonal(diagdir, dir, d-1);
     else
-      children[2]->updateDiagonal(diagdir, dir, d-1);
+      children[2].updateDiagonal(diagdir, dir, d-1);
   }
 
 }
@@ -220,7 +865,7 @@ void SmartQuadtree<T>::updateDiagonal(unsigned char diagdir,
 template<typename T>
 bool SmartQuadtree<T>::incrementDelta(unsigned char dir, bool flag)
 {
-  if (children[0] == NULL)
+  if (children == NULL)
   {
     if (delta[dir] < 1) delta[dir] += 1;
     return false;
@@ -230,35 +875,35 @@ bool SmartQuadtree<T>::incrementDelta(unsigned char dir, bool flag)
   {
     if (dir == WEST)
     {
-      children[0]->updateDiagonal(NORTHWEST, dir, 0);
-      children[2]->updateDiagonal(SOUTHWEST, dir, 0);
+      children[0].updateDiagonal(NORTHWEST, dir, 0);
+      children[2].updateDiagonal(SOUTHWEST, dir, 0);
     }
     if (dir == SOUTH)
     {
-      children[0]->updateDiagonal(SOUTHEAST, dir, 0);
-      children[1]->updateDiagonal(SOUTHWEST, dir, 0);
+      children[0].updateDiagonal(SOUTHEAST, dir, 0);
+      children[1].updateDiagonal(SOUTHWEST, dir, 0);
     }
     if (dir == EAST)
     {
-      children[1]->updateDiagonal(NORTHEAST, dir, 0);
-      children[3]->updateDiagonal(SOUTHEAST, dir, 0);
+      children[1].updateDiagonal(NORTHEAST, dir, 0);
+      children[3].updateDiagonal(SOUTHEAST, dir, 0);
     }
     if (dir == NORTH)
     {
-      children[2]->updateDiagonal(NORTHEAST, dir, 0);
-      children[3]->updateDiagonal(NORTHWEST, dir, 0);
+      children[2].updateDiagonal(NORTHEAST, dir, 0);
+      children[3].updateDiagonal(NORTHWEST, dir, 0);
     }
   }
 
 
   if ( dir < 3 ) // NORTHEAST
-    children[3]->incrementDelta(dir, false);
+    children[3].incrementDelta(dir, false);
   if ( ((dir + 6) & 7) < 3 ) // NORTHWEST
-    children[2]->incrementDelta(dir, false);
+    children[2].incrementDelta(dir, false);
   if ( ((dir + 4) & 7) < 3 ) // SOUTHWEST
-    children[0]->incrementDelta(dir, false);
+    children[0].incrementDelta(dir, false);
   if ( ((dir + 2) & 7) < 3 ) // SOUTHEAST
-    children[1]->incrementDelta(dir, false);
+    children[1].incrementDelta(dir, false);
   return true;
 }
 
@@ -268,63 +913,575 @@ template<typename T>
 void SmartQuadtree<T>::updateDelta(unsigned char dir)
 {
   if ( dir < 3 ) // NORTHEAST corner
-    if (children[3]->samelevel(dir)->children[0] != NULL)
-      children[3]->delta[dir] = 1;
+    if (children[3].samelevel(dir)->children != NULL)
+      children[3].delta[dir] = 1;
   if ( ((dir + 6) & 7) < 3 ) // NORTHWEST corner
-    if (children[2]->samelevel(dir)->children[0] != NULL)
-      children[2]->delta[dir] = 1;
+    if (children[2].samelevel(dir)->children != NULL)
+      children[2].delta[dir] = 1;
   if ( ((dir + 4) & 7) < 3 ) // SOUTHWEST corner
-    if (children[0]->samelevel(dir)->children[0] != NULL)
-      children[0]->delta[dir] = 1;
+    if (children[0].samelevel(dir)->children != NULL)
+      children[0].delta[dir] = 1;
   if ( ((dir + 2) & 7) < 3 ) // SOUTHEAST corner
-    if (children[1]->samelevel(dir)->children[0] != NULL)
-      children[1]->delta[dir] = 1;
+    if (children[1].samelevel(dir)->children != NULL)
+      children[1].delta[dir] = 1;
+}
+
+template<typename T>
+typename TypeDescriptor<T>::const_pointer
+SmartQuadtree<T>::attach(typename Storage::Moving& pt)
+{
+  tree->resize(points.size(), points.size() + 1);
+  if (!tree->indexed)
+  {
+    points.push_back(pt, tree->buckets);
+    return TypeDescriptor<T>::getPtr(points.back());
+  }
+  // Over capacity, the array moves: all addresses change
+  if (points.reallocates())
+    for (typename Storage::iterator it = points.begin();
+         it != points.end(); ++it)
+      tree->where.erase(TypeDescriptor<T>::getPtr(*it));
+  if (points.push_back(pt, tree->buckets))
+  {
+    for (typename Storage::iterator it = points.begin();
+         it != points.end(); ++it)
+      tree->where[TypeDescriptor<T>::getPtr(*it)] = this;
+    return TypeDescriptor<T>::getPtr(points.back());
+  }
+  tree->where[TypeDescriptor<T>::getPtr(points.back())] = this;
+  return TypeDescriptor<T>::getPtr(points.back());
+}
+
+template<typename T>
+typename SmartQuadtree<T>::Storage::Moving
+SmartQuadtree<T>::detach(typename Storage::iterator pos)
+{
+  tree->resize(points.size(), points.size() - 1);
+  if (!tree->indexed) return points.take(pos, tree->buckets);
+  tree->where.erase(TypeDescriptor<T>::getPtr(*pos));
+  if (Storage::stable || pos + 1 == points.end())
+    return points.take(pos, tree->buckets);
+  // The last element takes the place of the removed one
+  tree->where.erase(TypeDescriptor<T>::getPtr(points.back()));
+  typename Storage::Moving m = points.take(pos, tree->buckets);
+  tree->where[TypeDescriptor<T>::getPtr(*pos)] = this;
+  return m;
+}
+
+template<typename T>
+typename SmartQuadtree<T>::Storage::iterator
+SmartQuadtree<T>::lookup(const T& p)
+{
+  typename TypeDescriptor<T>::const_pointer ptr = TypeDescriptor<T>::getPtr(p);
+  typename Storage::iterator it = points.at(&p), ie = points.end();
+  if (it != ie) return it;
+  it = points.begin();
+  for ( ; it != ie; ++it)
+    if (TypeDescriptor<T>::getPtr(*it) == ptr) return it;
+  return ie;
+}
+
+template<typename T>
+signed char SmartQuadtree<T>::computeDelta(unsigned char dir) const
+{
+  static const int dx[8] = { 1, 1, 0, -1, -1, -1,  0,  1 };
+  static const int dy[8] = { 0, 1, 1,  1,  0, -1, -1, -1 };
+
+  // Coordinates of the quadrant on the grid of its level
+  long x = 0, y = 0, side = 1L << level;
+  for (unsigned char i = 0; i < level; ++i)
+  {
+    x |= ((location >> (2 * i)) & 1) << i;
+    y |= ((location >> (2 * i + 1)) & 1) << i;
+  }
+  x += dx[dir]; y += dy[dir];
+  bool outx = (x < 0 || x >= side), outy = (y < 0 || y >= side);
+  // Diagonals along the border are flagged like those across siblings
+  if (outx || outy) return ((outx && outy) || !(dir & 1) ? 2 : 3);
+
+  SmartQuadtree<T>* q =
+    getQuadrant(Neighbour::samelevel(location, dir, level), level);
+  if (q->level == level) return (NULL == q->children ? 0 : 1);
+
+  // A larger diagonal neighbour may be the neighbour on one side as well
+  if ((dir & 1) &&
+      ((q == getQuadrant(Neighbour::samelevel(location, dir - 1, level),
+                         level)) ||
+       (q == getQuadrant(Neighbour::samelevel(location, (dir + 1) & 7, level),
+                         level))))
+    return 3;
+
+  return q->level - level;
+}
+
+template<typename T>
+void SmartQuadtree<T>::refreshDelta(unsigned char dir)
+{
+  if (children == NULL)
+  {
+    for (unsigned char i = 0; i < 8; ++i) delta[i] = computeDelta(i);
+    return;
+  }
+
+  if ( dir < 3 ) // NORTHEAST
+    children[3].refreshDelta(dir);
+  if ( ((dir + 6) & 7) < 3 ) // NORTHWEST
+    children[2].refreshDelta(dir);
+  if ( ((dir + 4) & 7) < 3 ) // SOUTHWEST
+    children[0].refreshDelta(dir);
+  if ( ((dir + 2) & 7) < 3 ) // SOUTHEAST
+    children[1].refreshDelta(dir);
+}
+
+template<typename T>
+void SmartQuadtree<T>::merge()
+{
+  assert(NULL != children);
+
+  // Children are contiguous in the list of leaves, NE first
+  leaf = tree->leaves.insert(children[3].leaf, this);
+  tree->tally(level, 0, 1);
+
+  for (unsigned char i = 0; i < 4; ++i)
+  {
+    SmartQuadtree<T>& child = children[i];
+    assert(NULL == child.children);
+    tree->leaves.erase(child.leaf);
+    tree->tally(child.level, child.points.size(), -1);
+    for (typename Storage::iterator it = child.points.begin();
+         it != child.points.end(); ++it)
+    {
+      if (tree->indexed) tree->where.erase(TypeDescriptor<T>::getPtr(*it));
+      typename Storage::Moving m = child.points.release(it);
+      attach(m);
+    }
+    child.~SmartQuadtree();
+  }
+  tree->quadrants.release(children);
+  children = NULL;
+
+  // Deltas of a node with children are not maintained: compute them again,
+  // then update the leaves along the sides of the quadrant
+  for (unsigned char i = 0; i < 8; ++i) delta[i] = computeDelta(i);
+  for (unsigned char i = 0; i < 8; ++i)
+    if (delta[i] == 0 || delta[i] == 1)
+      samelevel(i)->refreshDelta((i + 4) & 7);
+}
+
+template<typename T>
+unsigned long SmartQuadtree<T>::coarsen(unsigned int lowWater)
+{
+  assert(lowWater <= tree->capacity);
+  if (NULL == children) return 0;
+
+  unsigned long merged = 0;
+  for (unsigned char i = 0; i < 4; ++i)
+    merged += children[i].coarsen(lowWater);
+
+  std::size_t size = 0;
+  for (unsigned char i = 0; i < 4; ++i)
+  {
+    if (NULL != children[i].children) return merged;
+    size += children[i].points.size();
+  }
+  if (size > lowWater) return merged;
+
+  merge();
+  return merged + 1;
+}
+
+template<typename T>
+void SmartQuadtree<T>::index()
+{
+  if (tree->indexed) return;
+  std::size_t size = 0;
+  typename list<SmartQuadtree<T>*>::iterator leaf = tree->leaves.begin();
+  for ( ; leaf != tree->leaves.end(); ++leaf) size += (*leaf)->points.size();
+  tree->where.clear();
+  tree->where.reserve(size);
+  for (leaf = tree->leaves.begin(); leaf != tree->leaves.end(); ++leaf)
+    for (typename Storage::iterator it = (*leaf)->points.begin();
+         it != (*leaf)->points.end(); ++it)
+      tree->where[TypeDescriptor<T>::getPtr(*it)] = *leaf;
+  tree->indexed = true;
+}
+
+template<typename T>
+void SmartQuadtree<T>::recount()
+{
+  tree->size = 0;
+  tree->levels.assign(1, 0);
+  tree->sizes.assign(1, 0);
+  tree->depth = 0;
+  tree->fullest = 0;
+  typename list<SmartQuadtree<T>*>::iterator leaf = tree->leaves.begin();
+  for ( ; leaf != tree->leaves.end(); ++leaf)
+  {
+    tree->size += (*leaf)->points.size();
+    tree->tally((*leaf)->level, (*leaf)->points.size(), 1);
+  }
 }
 
 template<typename T>
 void SmartQuadtree<T>::removeData(T& p)
 {
-  SmartQuadtree* e = ancestor->where[TypeDescriptor<T>::getPtr(p)];
+  index();
+  SmartQuadtree* e = tree->where[TypeDescriptor<T>::getPtr(p)];
   assert (e != NULL);
-  assert (e->points.end() != std::find(e->points.begin(), e->points.end(), p));
+  typename Storage::iterator pos = e->lookup(p);
+  assert (pos != e->points.end());
 
-  e->points.remove(p);
-  ancestor->where.erase(TypeDescriptor<T>::getPtr(p));
+  typename Storage::Moving m = e->detach(pos);
+  Storage::drop(m, tree->buckets);
+  --tree->size;
 }
 
 template<typename T>
 bool SmartQuadtree<T>::updateData(T& p)
 {
-  SmartQuadtree* e = ancestor->where[TypeDescriptor<T>::getPtr(p)];
+  index();
+  SmartQuadtree* e = tree->where[TypeDescriptor<T>::getPtr(p)];
   assert (e != NULL);
-  assert (e->points.end() != std::find(e->points.begin(), e->points.end(), p));
+  typename Storage::iterator pos = e->lookup(p);
+  assert (pos != e->points.end());
 
   if (e->contains(p)) return false;
-  e->points.remove(p);
-//   ancestor.where.erase(TypeDescriptor<T>::getPtr(p));
-  ancestor->insert(p);
+  typename Storage::Moving m = e->detach(pos);
+  e->reinsert(m);
+  return true;
+}
+
+template<typename T>
+T* SmartQuadtree<T>::access(typename TypeDescriptor<T>::const_pointer p)
+{
+  index();
+  if (tree->where.count(p) == 0) return NULL;
+  Storage& points = tree->where[p]->points;
+  for (typename Storage::iterator it = points.begin(); it != points.end(); ++it)
+    if (TypeDescriptor<T>::getPtr(*it) == p) return &*it;
+  return NULL;
+}
+
+template<typename T>
+typename TypeDescriptor<T>::const_pointer
+SmartQuadtree<T>::reinsert(typename Storage::Moving& p)
+{
+  // Elements usually move to a close cell: no need to start from the root
+  // The tolerance in contains() grows with the size of the cell: a cell may
+  // contain the data while none of its children does, hence the loop.
+  SmartQuadtree<T>* node = this;
+  typename TypeDescriptor<T>::const_pointer ptr;
+  while (NULL == (ptr = node->insert(p)) && NULL != node->parent)
+    node = node->parent;
+  // Data out of the root are lost
+  if (NULL == ptr)
+  {
+    Storage::drop(p, tree->buckets);
+    --tree->size;
+  }
+  return ptr;
+}
+
+template<typename T>
+unsigned long SmartQuadtree<T>::rebalance()
+{
+  std::vector<std::pair<SmartQuadtree<T>*, typename Storage::Moving> >
+    escaped;
+
+  // Collect elements out of their cell in one sweep over the leaves
+  typename list<SmartQuadtree<T>*>::iterator leaf = tree->leaves.begin();
+  for ( ; leaf != tree->leaves.end(); ++leaf)
+  {
+    Storage& data = (*leaf)->points;
+    for (typename Storage::iterator it = data.begin(); it != data.end(); )
+      if (!(*leaf)->b.contains(*it))
+      {
+        // the last element takes its place: do not increment it
+        escaped.push_back(std::make_pair(*leaf, (*leaf)->detach(it)));
+      }
+      else
+        ++it;
+  }
+
+  // Nodes are never freed by insertions, so leaves are still valid here
+  for (std::size_t i = 0; i < escaped.size(); ++i)
+    escaped[i].first->reinsert(escaped[i].second);
+
+  return escaped.size();
+}
+
+template<typename T>
+template<typename Function>
+void SmartQuadtree<T>::visitPairs(PolygonMask* mask, Function& fn,
+                                  Scratch& scratch) const
+{
+  typedef typename TypeDescriptor<T>::const_pointer const_pointer;
+
+  // Forward neighbours, as in const_iterator::forward_begin(); data of
+  // leaves partially covered by the mask are read through the indices kept
+  // in [first, last)
+  const SmartQuadtree<T>* nb[8];
+  bool partial[9];
+  std::size_t first[9], last[9];
+  std::size_t count = 0;
+
+  if (points.size() == 0) return;
+  if (!visitedData(mask, scratch, partial[8], first[8], last[8])) return;
+
+  for (unsigned char i = 0; i < 8; ++i)
+    if (delta[i] < (i < 4 ? 1 : 0))
+    {
+      nb[count] = samelevel(i);
+      if (nb[count]->visitedData(mask, scratch, partial[count], first[count],
+                                 last[count]))
+        ++count;
+    }
+
+  std::size_t size = (partial[8] ? last[8] - first[8] : points.size());
+  for (std::size_t i = 0; i < size; ++i)
+  {
+    std::size_t ia = (partial[8] ? scratch.kept[first[8] + i] : i);
+    const_pointer a = TypeDescriptor<T>::getPtr(points[ia]);
+    if (partial[8])
+      for (std::size_t j = first[8] + i + 1; j < last[8]; ++j)
+        fn(a, TypeDescriptor<T>::getPtr(points[scratch.kept[j]]));
+    else
+      for (std::size_t j = i + 1; j < size; ++j)
+        fn(a, TypeDescriptor<T>::getPtr(points[j]));
+    for (std::size_t k = 0; k < count; ++k)
+    {
+      const Storage& data = nb[k]->points;
+      if (partial[k])
+        for (std::size_t j = first[k]; j < last[k]; ++j)
+          fn(a, TypeDescriptor<T>::getPtr(data[scratch.kept[j]]));
+      else
+        for (std::size_t j = 0; j < data.size(); ++j)
+          fn(a, TypeDescriptor<T>::getPtr(data[j]));
+    }
+  }
+}
+
+template<typename T>
+template<typename Function>
+void SmartQuadtree<T>::visitWithin(PolygonMask* mask, float radius,
+                                   Function& fn, Scratch& scratch) const
+{
+  // Same neighbours as in visitPairs
+  const SmartQuadtree<T>* nb[8];
+  bool partial[9];
+  std::size_t first[9], last[9];
+  std::size_t count = 0;
+
+  if (points.size() == 0) return;
+  if (!visitedData(mask, scratch, partial[8], first[8], last[8])) return;
+
+  for (unsigned char i = 0; i < 8; ++i)
+    if (delta[i] < (i < 4 ? 1 : 0))
+    {
+      nb[count] = samelevel(i);
+      if (nb[count]->visitedData(mask, scratch, partial[count],
+                                 first[count], last[count]))
+        ++count;
+    }
+
+  // Data of this leaf come first, then data of each neighbour k in
+  // [begin[k], begin[k + 1]), within their extent box[k]
+  float box[9][4];
+  std::size_t begin[9];
+  gather(scratch, partial[8], first[8], last[8], box[8]);
+  std::size_t size = scratch.x.size();
+  for (std::size_t k = 0; k < count; ++k)
+  {
+    begin[k] = scratch.x.size();
+    nb[k]->gather(scratch, partial[k], first[k], last[k], box[k]);
+  }
+  begin[count] = scratch.x.size();
+  scratch.hits.resize(scratch.x.size());
+
+  const float* x = scratch.x.data();
+  const float* y = scratch.y.data();
+  unsigned int* hits = scratch.hits.data();
+  float r2 = radius * radius;
+
+  for (std::size_t i = 0; i < size; ++i)
+  {
+    typename TypeDescriptor<T>::const_pointer a = scratch.data[i];
+    std::size_t n = Simd::closerThan(x + i + 1, y + i + 1, size - i - 1,
+                                     x[i], y[i], r2, hits);
+    for (std::size_t h = 0; h < n; ++h) fn(a, scratch.data[i + 1 + hits[h]]);
+
+    for (std::size_t k = 0; k < count; ++k)
+    {
+      // Computed as in the kernel: no data of the box can be any closer
+      float dx = (x[i] < box[k][0] ? box[k][0] - x[i] :
+                  x[i] > box[k][1] ? x[i] - box[k][1] : 0);
+      float dy = (y[i] < box[k][2] ? box[k][2] - y[i] :
+                  y[i] > box[k][3] ? y[i] - box[k][3] : 0);
+      if (!(dx * dx + dy * dy < r2)) continue;
+      n = Simd::closerThan(x + begin[k], y + begin[k], begin[k + 1] - begin[k],
+                           x[i], y[i], r2, hits);
+      for (std::size_t h = 0; h < n; ++h)
+        fn(a, scratch.data[begin[k] + hits[h]]);
+    }
+  }
+}
+
+template<typename T>
+void SmartQuadtree<T>::gather(Scratch& scratch, bool partial,
+                              std::size_t first, std::size_t last,
+                              float* box) const
+{
+  box[0] = box[2] = std::numeric_limits<float>::max();
+  box[1] = box[3] = -std::numeric_limits<float>::max();
+  std::size_t n = (partial ? last - first : points.size());
+  for (std::size_t i = 0; i < n; ++i)
+  {
+    const T& p = points[partial ? scratch.kept[first + i] : i];
+    float x = BoundaryXY<T>::getX(p), y = BoundaryXY<T>::getY(p);
+    scratch.x.push_back(x);
+    scratch.y.push_back(y);
+    scratch.data.push_back(TypeDescriptor<T>::getPtr(p));
+    if (x < box[0]) box[0] = x;
+    if (x > box[1]) box[1] = x;
+    if (y < box[2]) box[2] = y;
+    if (y > box[3]) box[3] = y;
+  }
+}
+
+template<typename T>
+bool SmartQuadtree<T>::visitedData(PolygonMask* mask, Scratch& scratch,
+                                   bool& partial, std::size_t& first,
+                                   std::size_t& last) const
+{
+  partial = false;
+  first = last = scratch.kept.size();
+  if (mask == NULL) return true;
+  Coverage c = coverage(*mask);
+  if (c == OUTSIDE) return false;
+  if (c == INSIDE) return true;
+
+  partial = true;
+  inPolygon(*mask, points.begin(), points.end(), scratch.px, scratch.py,
+            scratch.inside);
+  for (std::size_t i = 0; i < points.size(); ++i)
+    if (scratch.inside[i]) scratch.kept.push_back(i);
+  last = scratch.kept.size();
   return true;
 }
 
+template<typename T>
+void SmartQuadtree<T>::inPolygon(const PolygonMask& mask,
+                                 typename Storage::const_iterator first,
+                                 typename Storage::const_iterator last,
+                                 std::vector<float>& x, std::vector<float>& y,
+                                 std::vector<char>& inside)
+{
+  x.clear();
+  y.clear();
+  for ( ; first != last; ++first)
+  {
+    x.push_back(BoundaryXY<T>::getX(*first));
+    y.push_back(BoundaryXY<T>::getY(*first));
+  }
+  inside.resize(x.size());
+  mask.pointsInPolygon(x.data(), y.data(), x.size(), inside.data());
+}
+
+template<typename T>
+template<typename Function, typename LeafIterator>
+void SmartQuadtree<T>::visitChunks(const std::vector<LeafIterator>& bounds,
+                                   PolygonMask* mask, float radius,
+                                   Function* fn,
+                                   std::atomic<std::size_t>& next)
+{
+  // Grows to the largest leaf and its neighbours, then allocates no more
+  Scratch scratch;
+  for (std::size_t i = next++; i + 1 < bounds.size(); i = next++)
+    for (LeafIterator leaf = bounds[i]; leaf != bounds[i + 1]; ++leaf)
+    {
+      scratch.kept.clear();
+      scratch.x.clear();
+      scratch.y.clear();
+      scratch.data.clear();
+      if (radius < 0) (*leaf)->visitPairs(mask, *fn, scratch);
+      else (*leaf)->visitWithin(mask, radius, *fn, scratch);
+    }
+}
+
+template<typename T>
+template<typename Function, typename LeafIterator>
+void SmartQuadtree<T>::visitLeaves(LeafIterator first, LeafIterator last,
+                                   std::size_t size, Function& fn,
+                                   unsigned int threads, PolygonMask* mask,
+                                   float radius)
+{
+  // Chunks small enough for threads to share the work when leaves are not
+  // equally loaded
+  std::size_t chunk = size / (16 * threads) + 1;
+  std::vector<LeafIterator> bounds;
+  for (std::size_t i = 0; first != last; ++first, ++i)
+    if (i % chunk == 0) bounds.push_back(first);
+  bounds.push_back(last);
+
+  std::atomic<std::size_t> next(0);
+  std::vector<std::thread> workers;
+  for (unsigned int i = 1; i < threads && i + 1 < bounds.size(); ++i)
+    workers.push_back(std::thread(visitChunks<Function, LeafIterator>,
+                                  std::cref(bounds), mask, radius, &fn,
+                                  std::ref(next)));
+  visitChunks(bounds, mask, radius, &fn, next);
+  for (std::size_t i = 0; i < workers.size(); ++i) workers[i].join();
+}
+
+template<typename T>
+template<typename Function>
+void SmartQuadtree<T>::visit(Function& fn, unsigned int threads,
+                             PolygonMask* mask, float radius) const
+{
+  if (threads == 0) threads = std::thread::hardware_concurrency();
+  if (threads == 0) threads = 1;
+
+  if (mask == NULL)
+  {
+    visitLeaves(tree->leaves.cbegin(), tree->leaves.cend(),
+                tree->leaves.size(), fn, threads, mask, radius);
+    return;
+  }
+
+  // Subtrees outside the mask are left out from the root down
+  std::vector<const SmartQuadtree<T>*> leaves;
+  tree->root->collect(*mask, leaves);
+  visitLeaves(leaves.cbegin(), leaves.cend(), leaves.size(), fn, threads,
+              mask, radius);
+}
+
 template<typename T>
 SmartQuadtree<T>::const_iterator::const_iterator(
     const typename list<SmartQuadtree<T>*>::const_iterator& begin,
     const typename list<SmartQuadtree<T>*>::const_iterator& end,
-    PolygonMask* mask) : polygonmask(mask), neighbours_computed(false)
+    PolygonMask* mask) : polygonmask(mask), inside(NULL), prune(false),
+                         neighbours_computed(false)
 {
   leafIterator = begin;
   leafEnd = end;
   aux = 4; // Default case: polygonmask is not set
   if (begin != end)
   {
-    it = (*leafIterator)->points.begin();
-    itEnd = (*leafIterator)->points.end();
+    prune = (end == (*begin)->tree->leaves.end());
     if (polygonmask != NULL)
     {
       // In case the first leaf is out of the polygon
-      PolygonMask clip = polygonmask->clip((*leafIterator)->b);
-      aux = (*leafIterator)->b.coveredByPolygon(clip);
+      Coverage c = (prune ? enter(leafIterator, leafEnd, *polygonmask, inside)
+                    : (*leafIterator)->coverage(*polygonmask));
+      aux = (c == INSIDE ? 4 : 0);
+      if (leafIterator == leafEnd)
+      {
+        it = itEnd = typename Storage::const_iterator();
+        return;
+      }
     }
+    it = (*leafIterator)->points.begin();
+    itEnd = (*leafIterator)->points.end();
     // In case it = itEnd
     advanceToNextLeaf();
     assert(leafIterator != leafEnd ? it != itEnd : true);
@@ -351,6 +1508,8 @@ SmartQuadtree<T>::const_iterator::const_iterator(
   it = a.it;
   itEnd = a.itEnd;
   polygonmask = a.polygonmask;
+  inside = a.inside;
+  prune = a.prune;
   aux = a.aux;
 }
 
@@ -366,9 +1525,11 @@ void SmartQuadtree<T>::const_iterator::advanceToNextLeaf()
       if (leafIterator == leafEnd) return;
       if (polygonmask != NULL)
       {
-        PolygonMask clip = polygonmask->clip((*leafIterator)->b);
-        if (clip.getSize() < 3) continue;
-        aux = (*leafIterator)->b.coveredByPolygon(clip);
+        Coverage c = (prune ? enter(leafIterator, leafEnd, *polygonmask, inside)
+                      : (*leafIterator)->coverage(*polygonmask));
+        if (leafIterator == leafEnd) return;
+        if (c == OUTSIDE) continue;
+        aux = (c == INSIDE ? 4 : 0);
       }
       it = (*leafIterator)->points.begin();
       itEnd = (*leafIterator)->points.end();
@@ -406,49 +1567,40 @@ SmartQuadtree<T>::const_iterator::forward_begin()
 {
   if (!neighbours_computed)
   {
-    for (typename std::list<T>::const_iterator i = it ;
-         i != itEnd; ++i)
-      if (polygonmask == NULL)
+    // Data tested against the mask, a leaf at a time
+    std::vector<float> x, y;
+    std::vector<char> inside;
+
+    if (polygonmask == NULL)
+      for (typename Storage::const_iterator i = it ; i != itEnd; ++i)
         forward_cells_neighbours.push_back(TypeDescriptor<T>::getPtr(*i));
-      else
-        if (polygonmask->pointInPolygon(BoundaryXY<T>::getX(*i),
-                                        BoundaryXY<T>::getY(*i)))
+    else
+    {
+      inPolygon(*polygonmask, it, itEnd, x, y, inside);
+      for (typename Storage::const_iterator i = it ; i != itEnd; ++i)
+        if (inside[i - it])
           forward_cells_neighbours.push_back(TypeDescriptor<T>::getPtr(*i));
+    }
 
     SmartQuadtree<T>* nb;
-    for (size_t i = 0; i < 4; ++i)
-      if ((*leafIterator)->delta[i] < 1) {
-        nb = (*leafIterator)->samelevel(i);
-        if (polygonmask != NULL)
-          if (polygonmask->clip(nb->b).getSize() < 3)
-            continue;
-        typename list<T>::const_iterator j = nb->getPoints().begin();
-        if (polygonmask == NULL ||
-            nb->b.coveredByPolygon(polygonmask->clip(nb->b)) == 4)
-          for (; j != nb->getPoints().end(); ++j)
-            forward_cells_neighbours.push_back(TypeDescriptor<T>::getPtr(*j));
-        else
-          for (; j != nb->getPoints().end(); ++j)
-            if (polygonmask->pointInPolygon(BoundaryXY<T>::getX(*j),
-                                            BoundaryXY<T>::getY(*j)))
-              forward_cells_neighbours.push_back(TypeDescriptor<T>::getPtr(*j));
-      }
-    for (size_t i = 4; i < 8; ++i)
-      if ((*leafIterator)->delta[i] < 0) {
+    for (size_t i = 0; i < 8; ++i)
+      if ((*leafIterator)->delta[i] < (i < 4 ? 1 : 0)) {
         nb = (*leafIterator)->samelevel(i);
+        Coverage c = INSIDE;
         if (polygonmask != NULL)
-          if (polygonmask->clip(nb->b).getSize() < 3)
+          if ((c = nb->coverage(*polygonmask)) == OUTSIDE)
             continue;
-        typename list<T>::const_iterator j = nb->getPoints().begin();
-        if (polygonmask == NULL ||
-            nb->b.coveredByPolygon(polygonmask->clip(nb->b)) == 4)
+        typename Storage::const_iterator j = nb->getPoints().begin();
+        if (c == INSIDE)
           for (; j != nb->getPoints().end(); ++j)
             forward_cells_neighbours.push_back(TypeDescriptor<T>::getPtr(*j));
         else
+        {
+          inPolygon(*polygonmask, j, nb->getPoints().end(), x, y, inside);
           for (; j != nb->getPoints().end(); ++j)
-            if (polygonmask->pointInPolygon(BoundaryXY<T>::getX(*j),
-                                            BoundaryXY<T>::getY(*j)))
+            if (inside[j - nb->getPoints().begin()])
               forward_cells_neighbours.push_back(TypeDescriptor<T>::getPtr(*j));
+        }
       }
     forward_cells_begin = forward_cells_neighbours.begin();
     neighbours_computed = true;
@@ -472,12 +1624,12 @@ SmartQuadtree<T>::const_iterator::forward_end()
 template<typename T>
 typename SmartQuadtree<T>::const_iterator::reference
 SmartQuadtree<T>::const_iterator::operator*()
-{ return it.operator*(); }
+{ return *it; }
 
 template<typename T>
 typename SmartQuadtree<T>::const_iterator::pointer
 SmartQuadtree<T>::const_iterator::operator->()
-{ return it.operator->(); }
+{ return &*it; }
 
 template<typename T> bool
 SmartQuadtree<T>::const_iterator::operator==(
@@ -497,21 +1649,34 @@ template<typename T>
 SmartQuadtree<T>::iterator::iterator(
     const typename list<SmartQuadtree<T>*>::iterator& begin,
     const typename list<SmartQuadtree<T>*>::iterator& end,
-    PolygonMask* mask) : polygonmask(mask)
+    PolygonMask* mask) : epoch(0), polygonmask(mask), inside(NULL),
+                         prune(false)
 {
   leafIterator = begin;
   leafEnd = end;
   aux = 4; // Default case: polygonmask is not set
   if (begin != end)
   {
-    it = (*leafIterator)->points.begin();
-    itEnd = (*leafIterator)->points.end();
+    // A new sweep starts (0 is the stamp of new elements)
+    typename SmartQuadtree<T>::Tree* tree = (*leafIterator)->tree;
+    if (0 == ++tree->epoch) ++tree->epoch;
+    epoch = tree->epoch;
+
+    prune = (end == tree->leaves.end());
     if (polygonmask != NULL)
     {
       // In case the first leaf is out of the polygon
-      PolygonMask clip = polygonmask->clip((*leafIterator)->b);
-      aux = (*leafIterator)->b.coveredByPolygon(clip);
+      Coverage c = (prune ? enter(leafIterator, leafEnd, *polygonmask, inside)
+                    : (*leafIterator)->coverage(*polygonmask));
+      aux = (c == INSIDE ? 4 : 0);
+      if (leafIterator == leafEnd)
+      {
+        it = itEnd = typename Storage::iterator();
+        return;
+      }
     }
+    it = (*leafIterator)->points.begin();
+    itEnd = (*leafIterator)->points.end();
     // In case it = itEnd
     advanceToNextLeaf();
     assert(leafIterator != leafEnd ? it != itEnd : true);
@@ -538,9 +1703,11 @@ void SmartQuadtree<T>::iterator::advanceToNextLeaf()
       if (leafIterator == leafEnd) return;
       if (polygonmask != NULL)
       {
-        PolygonMask clip = polygonmask->clip((*leafIterator)->b);
-        if (clip.getSize() < 3) continue;
-        aux = (*leafIterator)->b.coveredByPolygon(clip);
+        Coverage c = (prune ? enter(leafIterator, leafEnd, *polygonmask, inside)
+                      : (*leafIterator)->coverage(*polygonmask));
+        if (leafIterator == leafEnd) return;
+        if (c == OUTSIDE) continue;
+        aux = (c == INSIDE ? 4 : 0);
       }
       it = (*leafIterator)->points.begin();
       itEnd = (*leafIterator)->points.end();
@@ -555,21 +1722,16 @@ SmartQuadtree<T>::iterator::operator++()
   assert (it != itEnd);
   if (!(*leafIterator)->b.contains(*it))
   {
-    // Computing the proper neighbour is probably slower than finding it
-    // from the ancestor node...
-    SmartQuadtree<T>* previous =
-      (*leafIterator)->ancestor->where[TypeDescriptor<T>::getPtr(*it)];
-    assert (previous != NULL);
-
-    typename TypeDescriptor<T>::const_pointer newpos((*leafIterator)->ancestor->insert(*it));
-    SmartQuadtree<T>* current = (*leafIterator)->ancestor->where[newpos];
-    assert (current != NULL);
+    SmartQuadtree<T>* previous = *leafIterator;
 
-    (*leafIterator)->ancestor->where.erase(TypeDescriptor<T>::getPtr(*it));
+    // The last element of the leaf takes the place of the moving one
+    typename Storage::Moving moving = previous->detach(it);
+    itEnd = previous->points.end();
 
-    if (current->location > previous->location)
-      already.push_back(newpos);
-    it = (*leafIterator)->points.erase(it);
+    // The element is stamped so that it is not parsed again if it lands in
+    // a leaf further in the sweep
+    Storage::stamp(moving) = epoch;
+    previous->reinsert(moving);
   }
   else
     ++it;
@@ -578,8 +1740,8 @@ SmartQuadtree<T>::iterator::operator++()
 
   // Don't parse elements that are already parsed
   if (aux == 4)
-  while (already.end() != std::find(already.begin(), already.end(),
-                                    TypeDescriptor<T>::getPtr(*it)))
+  while (leafIterator != leafEnd &&
+         (*leafIterator)->points.stamp(it) == epoch)
   {
     ++it;
     advanceToNextLeaf();
@@ -591,8 +1753,7 @@ SmartQuadtree<T>::iterator::operator++()
     while ((leafIterator != leafEnd) &&
            (!polygonmask->pointInPolygon(BoundaryXY<T>::getX(*it),
                                          BoundaryXY<T>::getY(*it)) ||
-            already.end() != std::find(already.begin(), already.end(),
-                                       TypeDescriptor<T>::getPtr(*it)))
+            (*leafIterator)->points.stamp(it) == epoch)
           )
     {
       ++it;
@@ -606,12 +1767,12 @@ SmartQuadtree<T>::iterator::operator++()
 template<typename T>
 typename SmartQuadtree<T>::iterator::reference
 SmartQuadtree<T>::iterator::operator*()
-{ return it.operator*(); }
+{ return *it; }
 
 template<typename T>
 typename SmartQuadtree<T>::iterator::pointer
 SmartQuadtree<T>::iterator::operator->()
-{ return it.operator->(); }
+{ return &*it; }
 
 template<typename T> bool
 SmartQuadtree<T>::iterator::operator==(
@@ -626,19 +1787,31 @@ SmartQuadtree<T>::iterator::operator!=(
     const typename SmartQuadtree<T>::iterator& rhs) const
 { return !(*this == rhs); }
 
+template<typename T>
+typename SmartQuadtree<T>::Stats SmartQuadtree<T>::stats() const
+{
+  Stats s;
+  s.size = tree->size;
+  s.leaves = tree->leaves.size();
+  s.fullest = tree->fullest;
+  s.depth = tree->depth;
+  return s;
+}
+
 template<typename T>
 unsigned long SmartQuadtree<T>::getDataSize() const
 {
+  if (this == tree->root) return tree->fullest;
   unsigned long size = 0, tmp;
-  if (children[0] != NULL)
+  if (children != NULL)
   {
-    tmp = children[0]->getDataSize();
+    tmp = children[0].getDataSize();
     if (tmp > size) size = tmp;
-    tmp = children[1]->getDataSize();
+    tmp = children[1].getDataSize();
     if (tmp > size) size = tmp;
-    tmp = children[2]->getDataSize();
+    tmp = children[2].getDataSize();
     if (tmp > size) size = tmp;
-    tmp = children[3]->getDataSize();
+    tmp = children[3].getDataSize();
     if (tmp > size) size = tmp;
     return size;
   }
@@ -649,16 +1822,17 @@ unsigned long SmartQuadtree<T>::getDataSize() const
 template<typename T>
 unsigned char SmartQuadtree<T>::getDepth() const
 {
+  if (this == tree->root) return tree->depth;
   unsigned char depth = 0, tmp;
-  if (children[0] != NULL)
+  if (children != NULL)
   {
-    tmp = children[0]->getDepth();
+    tmp = children[0].getDepth();
     if (tmp > depth) depth = tmp;
-    tmp = children[1]->getDepth();
+    tmp = children[1].getDepth();
     if (tmp > depth) depth = tmp;
-    tmp = children[2]->getDepth();
+    tmp = children[2].getDepth();
     if (tmp > depth) depth = tmp;
-    tmp = children[3]->getDepth();
+    tmp = children[3].getDepth();
     if (tmp > depth) depth = tmp;
     return depth + 1;
   }
@@ -670,27 +1844,27 @@ template<typename T>
 typename SmartQuadtree<T>::const_iterator MaskedQuadtree<T>::begin() const
 {
   return typename SmartQuadtree<T>::const_iterator(
-      quadtree.leaves.begin(), quadtree.leaves.end(), polygonmask);
+      quadtree.tree->leaves.begin(), quadtree.tree->leaves.end(), polygonmask);
 }
 
 template<typename T>
 typename SmartQuadtree<T>::const_iterator MaskedQuadtree<T>::end() const
 {
   return typename SmartQuadtree<T>::const_iterator(
-      quadtree.leaves.end(), quadtree.leaves.end(), polygonmask);
+      quadtree.tree->leaves.end(), quadtree.tree->leaves.end(), polygonmask);
 }
 
 template<typename T>
 typename SmartQuadtree<T>::iterator MaskedQuadtree<T>::begin()
 {
   return typename SmartQuadtree<T>::iterator(
-      quadtree.leaves.begin(), quadtree.leaves.end(), polygonmask);
+      quadtree.tree->leaves.begin(), quadtree.tree->leaves.end(), polygonmask);
 }
 
 template<typename T>
 typename SmartQuadtree<T>::iterator MaskedQuadtree<T>::end()
 {
   return typename SmartQuadtree<T>::iterator(
-      quadtree.leaves.end(), quadtree.leaves.end(), polygonmask);
+      quadtree.tree->leaves.end(), quadtree.tree->leaves.end(), polygonmask);
 }
 
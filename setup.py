@@ -4,8 +4,10 @@ from Cython.Build import cythonize
 
 extensions = [
     Extension("smartquadtree",
-              ["smartquadtree.pyx", "quadtree.cpp", "neighbour.cpp"],
-              extra_compile_args=["-std=c++11"],
+              ["smartquadtree.pyx", "quadtree.cpp", "neighbour.cpp",
+               "simd.cpp"],
+              extra_compile_args=["-std=c++11", "-pthread"],
+              extra_link_args=["-pthread"],
               language="c++")
 ]
 
@@ -0,0 +1,159 @@
+/*
+ * Vectorised kernels on arrays of coordinates, for queries over many data of
+ * a quadtree at once. Each kernel falls back to plain loops when the
+ * instruction set it relies on is not available.
+ */
+
+#include "simd.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define SIMD_AVX2
+#endif
+
+namespace {
+
+typedef void (*InPolygon)(const float*, const float*, const float*,
+                          const float*, int, const float*, const float*,
+                          std::size_t, char*, std::size_t);
+
+// see PolygonMask::pointInPolygon, from data i on
+void inPolygon(const float* previousY, const float* polyY,
+               const float* constant, const float* multiple,
+               int size, const float* x, const float* y,
+               std::size_t n, char* inside, std::size_t i)
+{
+  for ( ; i < n; ++i)
+  {
+    bool oddNodes = false;
+    for (int e = 0; e < size; ++e)
+      if ((polyY[e] < y[i] && previousY[e] >= y[i]) ||
+          (previousY[e] < y[i] && polyY[e] >= y[i]))
+        oddNodes ^= (y[i] * multiple[e] + constant[e] < x[i]);
+    inside[i] = oddNodes;
+  }
+}
+
+#ifdef __SSE2__
+// Same as inPolygon, on four data at a time
+void inPolygonSSE2(const float* previousY, const float* polyY,
+                   const float* constant, const float* multiple,
+                   int size, const float* x, const float* y,
+                   std::size_t n, char* inside, std::size_t i)
+{
+  for ( ; i + 4 <= n; i += 4)
+  {
+    __m128 vx = _mm_loadu_ps(x + i), vy = _mm_loadu_ps(y + i);
+    __m128 odd = _mm_setzero_ps();
+    for (int e = 0; e < size; ++e)
+    {
+      __m128 ye = _mm_set1_ps(polyY[e]), yf = _mm_set1_ps(previousY[e]);
+      __m128 cross = _mm_or_ps(
+        _mm_and_ps(_mm_cmplt_ps(ye, vy), _mm_cmpge_ps(yf, vy)),
+        _mm_and_ps(_mm_cmplt_ps(yf, vy), _mm_cmpge_ps(ye, vy)));
+      __m128 left = _mm_cmplt_ps(
+        _mm_add_ps(_mm_mul_ps(vy, _mm_set1_ps(multiple[e])),
+                   _mm_set1_ps(constant[e])), vx);
+      odd = _mm_xor_ps(odd, _mm_and_ps(cross, left));
+    }
+    int mask = _mm_movemask_ps(odd);
+    for (unsigned int j = 0; j < 4; ++j) inside[i + j] = (mask >> j) & 1;
+  }
+  inPolygon(previousY, polyY, constant, multiple, size, x, y, n, inside, i);
+}
+#endif
+
+#ifdef SIMD_AVX2
+// Same as inPolygon, on eight data at a time
+__attribute__((target("avx2")))
+void inPolygonAVX2(const float* previousY, const float* polyY,
+                   const float* constant, const float* multiple,
+                   int size, const float* x, const float* y,
+                   std::size_t n, char* inside, std::size_t i)
+{
+  for ( ; i + 8 <= n; i += 8)
+  {
+    __m256 vx = _mm256_loadu_ps(x + i), vy = _mm256_loadu_ps(y + i);
+    __m256 odd = _mm256_setzero_ps();
+    for (int e = 0; e < size; ++e)
+    {
+      __m256 ye = _mm256_set1_ps(polyY[e]);
+      __m256 yf = _mm256_set1_ps(previousY[e]);
+      __m256 cross = _mm256_or_ps(
+        _mm256_and_ps(_mm256_cmp_ps(ye, vy, _CMP_LT_OQ),
+                      _mm256_cmp_ps(yf, vy, _CMP_GE_OQ)),
+        _mm256_and_ps(_mm256_cmp_ps(yf, vy, _CMP_LT_OQ),
+                      _mm256_cmp_ps(ye, vy, _CMP_GE_OQ)));
+      __m256 left = _mm256_cmp_ps(
+        _mm256_add_ps(_mm256_mul_ps(vy, _mm256_set1_ps(multiple[e])),
+                      _mm256_set1_ps(constant[e])), vx, _CMP_LT_OQ);
+      odd = _mm256_xor_ps(odd, _mm256_and_ps(cross, left));
+    }
+    int mask = _mm256_movemask_ps(odd);
+    for (unsigned int j = 0; j < 8; ++j) inside[i + j] = (mask >> j) & 1;
+  }
+  // The compiler may leave it out before a tail call: SSE code afterwards
+  // would then pay for the dirty upper halves of AVX registers
+  _mm256_zeroupper();
+  inPolygon(previousY, polyY, constant, multiple, size, x, y, n, inside, i);
+}
+#endif
+
+InPolygon selectInPolygon()
+{
+#ifdef SIMD_AVX2
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) return inPolygonAVX2;
+#endif
+#ifdef __SSE2__
+  return inPolygonSSE2;
+#else
+  return inPolygon;
+#endif
+}
+
+}
+
+std::size_t Simd::closerThan(const float* x, const float* y, std::size_t n,
+                             float ax, float ay, float r2,
+                             unsigned int* hits)
+{
+  std::size_t count = 0, i = 0;
+
+#ifdef __SSE2__
+  __m128 vx = _mm_set1_ps(ax), vy = _mm_set1_ps(ay), vr = _mm_set1_ps(r2);
+  for ( ; i + 4 <= n; i += 4)
+  {
+    __m128 dx = _mm_sub_ps(_mm_loadu_ps(x + i), vx);
+    __m128 dy = _mm_sub_ps(_mm_loadu_ps(y + i), vy);
+    __m128 d2 = _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy));
+    int mask = _mm_movemask_ps(_mm_cmplt_ps(d2, vr));
+    // Most data are far: one branch for four of them
+    if (mask == 0) continue;
+    for (unsigned int j = 0; j < 4; ++j)
+      if (mask & (1 << j)) hits[count++] = i + j;
+  }
+#endif
+
+  for ( ; i < n; ++i)
+  {
+    float dx = x[i] - ax, dy = y[i] - ay;
+    if (dx * dx + dy * dy < r2) hits[count++] = i;
+  }
+
+  return count;
+}
+
+void Simd::pointsInPolygon(const float* previousY, const float* polyY,
+                           const float* constant, const float* multiple,
+                           int size,
+                           const float* x, const float* y, std::size_t n,
+                           char* inside)
+{
+  static const InPolygon kernel = selectInPolygon();
+  kernel(previousY, polyY, constant, multiple, size, x, y, n, inside, 0);
+}
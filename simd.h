@@ -0,0 +1,34 @@
+/*
+ * Vectorised kernels on arrays of coordinates, for queries over many data of
+ * a quadtree at once. Each kernel falls back to plain loops when the
+ * instruction set it relies on is not available.
+ */
+
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <cstddef>
+
+class Simd
+{
+public:
+
+  //! Writes in hits the indices i < n such that the squared distance from
+  //! (x[i], y[i]) to (ax, ay) is less than r2
+  //! Returns the number of indices written
+  static std::size_t closerThan(const float* x, const float* y, std::size_t n,
+                                float ax, float ay, float r2,
+                                unsigned int* hits);
+
+  //! Writes in inside[i] whether (x[i], y[i]) is inside the polygon of size
+  //! edges described by the tables of PolygonMask, for all i < n: edge e
+  //! goes from ordinate previousY[e] to polyY[e]
+  //! Uses AVX2 when the processor has it (checked once at runtime)
+  static void pointsInPolygon(const float* previousY, const float* polyY,
+                              const float* constant, const float* multiple,
+                              int size,
+                              const float* x, const float* y, std::size_t n,
+                              char* inside);
+};
+
+#endif // SIMD_H
@@ -16,7 +16,8 @@ The proposed implementation efficiently addresses this problem.
 
 from libcpp cimport bool as cppbool
 from libcpp.vector cimport vector
-from cpython.ref cimport Py_INCREF, Py_DECREF
+from libc.stdint cimport int64_t
+from libc.string cimport memcpy
 from cython.operator cimport dereference as deref, preincrement as inc
 
 
@@ -32,6 +33,7 @@ cdef extern from *:
 cdef extern from "quadtree.h":
     cdef cppclass PolygonMask:
         PolygonMask(vector[float], vector[float], int)
+        PolygonMask(vector[vector[float]], vector[vector[float]])
     cdef cppclass SmartQuadtree[T]:
         cppclass const_iterator:
             const_iterator()
@@ -43,37 +45,63 @@ cdef extern from "quadtree.h":
             cpp_vector[const T*].const_iterator forward_end()
         cppclass iterator:
             iterator()
-            T operator*()
+            T& operator*()
             iterator operator++()
             bint operator==(iterator)
             bint operator!=(iterator)
+        cppclass Stats:
+            Stats()
+            unsigned long size
+            unsigned long leaves
+            unsigned long fullest
+            unsigned char depth
         SmartQuadtree(float, float, float, float, unsigned int)
         cppbool insert(T)
+        Stats stats()
         iterator begin()
         iterator end()
         const_iterator const_begin "begin" ()
         const_iterator const_end "end" ()
 
 cdef extern from "cython_additions.hpp":
-    double BoundaryXY_getX(long&)
-    double BoundaryXY_getY(long&)
+    cdef struct PyItem:
+        long obj
+        int64_t id
+        float x
+        float y
+    cdef cppclass ItemIndex:
+        ItemIndex()
     double size_limit
-    SmartQuadtree[long].iterator masked_begin(SmartQuadtree[long], PolygonMask*)
-    SmartQuadtree[long].const_iterator masked_const_begin(SmartQuadtree[long], PolygonMask*)
-
-cdef double BoundaryXY_getX(long& p):
-    cdef object o = <object> (<void*> p)
-    if isinstance(o, tuple) or isinstance(o, list):
-        return <double> o[0]
-    assert ("get_x" in dir(o))
-    return <double> o.get_x()
-
-cdef double BoundaryXY_getY(long& p):
-    cdef object o = <object> (<void*> p)
+    Py_ssize_t cpp_insert_many "insert_many" (
+        SmartQuadtree[PyItem]&, ItemIndex&, const double*, const double*,
+        const int64_t*, Py_ssize_t) nogil
+    Py_ssize_t cpp_update_positions "update_positions" (
+        SmartQuadtree[PyItem]&, ItemIndex&, const int64_t*, const double*,
+        const double*, Py_ssize_t) nogil
+    SmartQuadtree[PyItem].iterator masked_begin(SmartQuadtree[PyItem],
+                                                PolygonMask*)
+    SmartQuadtree[PyItem].const_iterator masked_const_begin(
+        SmartQuadtree[PyItem], PolygonMask*)
+    void cpp_neighbour_ids "neighbour_ids" (
+        SmartQuadtree[PyItem]&, PolygonMask*, float, vector[int64_t]&,
+        vector[int64_t]&) nogil
+
+cdef inline void read_xy(object o, PyItem* item):
+    """ Copies the coordinates of o into item: the only place where the
+    quadtree reads them from Python. """
     if isinstance(o, tuple) or isinstance(o, list):
-        return <double> o[1]
-    assert ("get_y" in dir(o))
-    return <double> o.get_y()
+        item.x = o[0]
+        item.y = o[1]
+    else:
+        item.x = o.get_x()
+        item.y = o.get_y()
+
+cdef inline object as_object(const PyItem& item):
+    """ The Python object stored in item, or its id if it was inserted with
+    insert_many. The object is borrowed from Quadtree.objects. """
+    if item.obj == 0:
+        return item.id
+    return <object> (<void*> item.obj)
 
 cdef class Quadtree(object):
     """ Main class for quadtrees
@@ -87,21 +115,28 @@ cdef class Quadtree(object):
     All methods attached to the Quadtree class are detailed below.
     """
     cdef PolygonMask* p
-    cdef SmartQuadtree[long]* q
+    cdef SmartQuadtree[PyItem]* q
+    cdef ItemIndex* items
+    # objects given to insert(), indexed by the ids it assigned: this list
+    # keeps them alive while the quadtree refers to them
+    cdef list objects
 
     def __cinit__(self, x0=None, y0=None, dim_x=None, dim_y=None, depth=8):
         self.p = NULL
         self.q = NULL
+        self.items = NULL
+        self.objects = []
         if any([p is None for p in [x0, y0, dim_x, dim_y]]):
-            print self.__doc__
+            print (self.__doc__)
             raise SyntaxError
-        self.q = new SmartQuadtree[long](x0, y0, dim_x, dim_y, depth)
+        self.q = new SmartQuadtree[PyItem](x0, y0, dim_x, dim_y, depth)
+        self.items = new ItemIndex()
 
     def __dealloc__(self):
         if self.q != NULL:
-            for x in self.elements():
-                Py_DECREF(<object> (<void*> x))
             del self.q
+        if self.items != NULL:
+            del self.items
         if self.p != NULL:
             del self.p
 
@@ -139,16 +174,34 @@ cdef class Quadtree(object):
         not need to close the polygon.
         >>> q.set_mask([ (0, 0), (1.5, 3), (3, 0) ])
 
+        A list of such rings makes a polygon with several parts or holes:
+        items are in the mask if they are inside an odd number of rings.
+        >>> q.set_mask([ [ (0, 0), (4, 0), (4, 4), (0, 4) ],
+        ...              [ (1, 1), (1, 3), (3, 3), (3, 1) ] ])
+
         You can set the mask to None in order to reset it.
         >>> q.set_mask(None)
 
         """
         cdef vector[float] vec_x, vec_y
+        cdef vector[vector[float]] rings_x, rings_y
         if self.p != NULL:
             del self.p
             self.p = NULL
         if coords is None:
             return
+        coords = list(coords)
+        if len(coords) > 0 and hasattr(coords[0][0], "__len__"):
+            for ring in coords:
+                vec_x.clear()
+                vec_y.clear()
+                for (x, y) in ring:
+                    vec_x.push_back(x)
+                    vec_y.push_back(y)
+                rings_x.push_back(vec_x)
+                rings_y.push_back(vec_y)
+            self.p = new PolygonMask(rings_x, rings_y)
+            return
         for (x, y) in coords:
             vec_x.push_back(x)
             vec_y.push_back(y)
@@ -185,31 +238,139 @@ cdef class Quadtree(object):
         It is not possible to switch between elt[0]/elt[1] and
         elt.get_x()/elt.get_y() after the first element has been inserted.
 
+        Coordinates are copied into the quadtree: they are read again by
+        update(), or by elements() for the elements it yields.
+
         All following examples are valid (provided that for q3, class Point
         implements get_x() and get_y().
         >>> q1.insert((1, 2))
         >>> q2.insert([1, 2])
         >>> q3.insert(Point(1, 2))
 
+        Returns the id of the element, None if it is outside the quadtree.
+        Ids count from 0 in order of insertion; neighbour_pairs() returns
+        them, and element() gives the element back.
+        >>> first, second = q.neighbour_pairs()
+        >>> a, b = q.element(first[0]), q.element(second[0])
+
         """
-        if self.q.insert(<long>(<void*> elt)):
-            Py_INCREF(elt)
+        cdef PyItem item
+        item.obj = <long>(<void*> elt)
+        item.id = len(self.objects)
+        read_xy(elt, &item)
+        if not self.q.insert(item):
+            return None
+        self.objects.append(elt)
+        return item.id
+
+    def element(self, int64_t id):
+        """ Returns the element which insert() gave this id. """
+        if id < 0 or id >= len(self.objects):
+            raise IndexError("no element inserted with id %d" % id)
+        return self.objects[id]
+
+    def update(self):
+        """ Reads the coordinates of all elements again, and moves them to
+        their new cells.
+
+        Masks, neighbourhoods and subdivisions only look at the coordinates
+        copied into the quadtree, never at the elements themselves. Call
+        update() after elements have moved, unless they were moved while
+        iterating over elements().
+        >>> for p in points: p.x += 1
+        >>> q.update()
+
+        """
+        cdef SmartQuadtree[PyItem].iterator it = self.q.begin()
+        cdef PyItem* item
+        while (it != self.q.end()):
+            item = &deref(it)
+            if item.obj != 0:
+                read_xy(<object> (<void*> item.obj), item)
+            inc(it)
+
+    def insert_many(self, const double[::1] xs, const double[::1] ys,
+                    const int64_t[::1] ids):
+        """ Inserts integer ids at positions xs, ys.
+
+        Arrays are contiguous NumPy arrays of the same length, with dtypes
+        np.float64 (xs, ys) and np.int64 (ids), whatever the platform: pass
+        dtype=np.int64 explicitly where the default integer is 32-bit
+        (Windows with NumPy < 2). The whole batch runs without the GIL;
+        no Python object is created. Iterating yields ids back as integers,
+        and their positions are set through update_positions().
+
+        Returns the number of elements inserted.
+        >>> q.insert_many(np.array([1., 2.]), np.array([3., 4.]),
+        >>>               np.array([0, 1], dtype=np.int64))
+
+        """
+        cdef Py_ssize_t n = ids.shape[0]
+        if xs.shape[0] != n or ys.shape[0] != n:
+            raise ValueError("xs, ys and ids must have the same length")
+        if n == 0:
+            return 0
+        with nogil:
+            n = cpp_insert_many(deref(self.q), deref(self.items), &xs[0],
+                                &ys[0], &ids[0], n)
+        return n
+
+    def update_positions(self, const int64_t[::1] ids,
+                         const double[::1] xs, const double[::1] ys):
+        """ Moves elements inserted with insert_many() to positions xs, ys.
+
+        Arrays follow the conventions of insert_many(); ids which are not
+        in the quadtree are ignored, and elements moved out of the quadtree
+        are removed. Each element is found by its id and written in place;
+        only those which left their cell move to another one. The whole
+        batch runs without the GIL.
+
+        Returns the number of elements updated.
+        >>> q.update_positions(ids, xs + vx * dt, ys + vy * dt)
+
+        """
+        cdef Py_ssize_t n = ids.shape[0]
+        if xs.shape[0] != n or ys.shape[0] != n:
+            raise ValueError("xs, ys and ids must have the same length")
+        if n == 0:
+            return 0
+        with nogil:
+            n = cpp_update_positions(deref(self.q), deref(self.items),
+                                     &ids[0], &xs[0], &ys[0], n)
+        return n
 
     def size(self, ignore_mask = True):
         """ Yields the size of the quadtree.
 
-        This function is equivalent to iterate with a lambda incrementing a
-        global variable.
-
-        By default, any masks are ignored.
+        By default, any masks are ignored: the size is maintained by the
+        quadtree and returned at once.
         >>> q.size()
 
-        If a mask is set, you can provide False to stop ignoring masks.
+        If a mask is set, you can provide False to stop ignoring masks. This
+        is then equivalent to iterate with a lambda incrementing a global
+        variable.
         >>> q.size(False)
 
         """
+        if self.p is NULL or ignore_mask:
+            return self.q.stats().size
         return sum(1 for x in self.elements(ignore_mask))
 
+    def stats(self):
+        """ Yields figures about the quadtree, as a dictionary.
+
+        They are maintained as elements come and go, and returned at once:
+        - size: number of elements,
+        - leaves: number of leaves,
+        - fullest: largest number of elements in a leaf,
+        - depth: level of the deepest leaf.
+        >>> q.stats()["depth"]
+
+        """
+        cdef SmartQuadtree[PyItem].Stats s = self.q.stats()
+        return dict(size = s.size, leaves = s.leaves, fullest = s.fullest,
+                    depth = s.depth)
+
     def elements(self, ignore_mask = False):
         """ Iterates over elements in the quadtree (generator).
 
@@ -217,8 +378,9 @@ cdef class Quadtree(object):
         parsing to elements inside a polygon defined in `set_mask`.
 
         As this method is a generator, elements are produced one by one and
-        their position is adjusted in the quadtree after you ask for the next
-        element. You are however certain never to get twice the same element.
+        their position is read again and adjusted in the quadtree after you
+        ask for the next element. You are however certain never to get twice
+        the same element.
 
         >>> for x in q.elements():
         >>>     print (x)
@@ -233,13 +395,21 @@ cdef class Quadtree(object):
         >>> for x in q.elements(ignore_mask = True):
         >>>     print (x)
         """
-        cdef SmartQuadtree[long].iterator it
+        cdef SmartQuadtree[PyItem].iterator it
+        cdef PyItem* item
         if self.p is NULL or ignore_mask:
             it = self.q.begin()
         else:
             it = masked_begin(deref(self.q), self.p)
         while (it != self.q.end()):
-            yield (<object>(<void*> deref(it)))
+            item = &deref(it)
+            elt = as_object(deref(item))
+            yield elt
+            # the generator may resume after the quadtree has changed: only
+            # the element yielded is read again, through the iterator
+            item = &deref(it)
+            if item.obj != 0:
+                read_xy(elt, item)
             inc(it)
 
     def neighbour_elements(self, ignore_mask = False):
@@ -269,17 +439,44 @@ cdef class Quadtree(object):
         >>> for a, b in q.neighbour_elements(ignore_mask = True):
         >>>     print (a, b)
         """
-        cdef SmartQuadtree[long].const_iterator it
+        cdef SmartQuadtree[PyItem].const_iterator it
         if self.p is NULL or ignore_mask:
             it = self.q.const_begin()
         else:
             it = masked_const_begin(deref(self.q), self.p)
-        cdef cpp_vector[const long*].const_iterator j
+        cdef cpp_vector[const PyItem*].const_iterator j
         while (it != self.q.const_end()):
             j = it.forward_begin()
             while (j != it.forward_end()):
-                yield(<object>(<void*> deref(it)),
-                        <object>(<void*> deref(deref(j))))
+                yield(as_object(deref(it)), as_object(deref(deref(j))))
                 inc(j)
             inc(it)
 
+    def neighbour_pairs(self, double radius = 0, ignore_mask = False):
+        """ Returns pairs of neighbours as two int64 NumPy arrays of ids.
+
+        Pairs are the same as in neighbour_elements(), or only those closer
+        than radius if radius is positive. The i-th pair is made of ids
+        first[i] and second[i], as given to insert_many() or returned by
+        insert() (see element()). The whole enumeration runs in C++ without
+        the GIL.
+
+        >>> first, second = q.neighbour_pairs(radius = 1.)
+        >>> d = np.hypot(xs[first] - xs[second], ys[first] - ys[second])
+
+        You can ignore the mask with the `ignore_mask` parameter
+        (default: False)
+        """
+        import numpy as np
+        cdef vector[int64_t] first, second
+        cdef PolygonMask* mask = <PolygonMask*>NULL if ignore_mask else self.p
+        with nogil:
+            cpp_neighbour_ids(deref(self.q), mask, radius, first, second)
+        a = np.empty(first.size(), dtype=np.int64)
+        b = np.empty(second.size(), dtype=np.int64)
+        cdef int64_t[::1] va = a, vb = b
+        if first.size() > 0:
+            memcpy(&va[0], &first[0], first.size() * sizeof(int64_t))
+            memcpy(&vb[0], &second[0], second.size() * sizeof(int64_t))
+        return a, b
+
@@ -0,0 +1,36 @@
+/*
+ * Data shared by the benchmarks: points with coordinates in a box, drawn
+ * with rand(), and a limit on the size of cells set by each benchmark.
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <cstdlib>
+
+#include "quadtree.h"
+
+struct Point {
+  float x, y;
+  Point(float x, float y) : x(x), y(y) {}
+  float distance2(const Point& p) const
+  { return (p.x - x) * (p.x - x) + (p.y - y) * (p.y - y); }
+};
+
+// Benchmarks keep no pointer to data: flat buckets are faster to parse
+template<>
+struct BucketType<Point>
+{
+  typedef Bucket<Point> type;
+};
+
+// Cells smaller than this go over capacity instead of splitting (0: none)
+double size_limit = 0.;
+
+template<>
+bool BoundaryLimit<Boundary>::limitation(const Boundary& b)
+{ return (b.norm_infty() < size_limit); }
+
+float uniform() { return ((float) rand()) / (float) RAND_MAX; }
+
+#endif // BENCH_H
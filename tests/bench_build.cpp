@@ -0,0 +1,53 @@
+/*
+ * Timings for bulk loading a quadtree with an increasing number of threads.
+ *
+ * Location codes are computed and sorted by the same threads as subtrees;
+ * copying the data and putting the subtrees back in place are serial.
+ */
+
+#include <cfloat>
+#include <cstdlib>
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "bench.h"
+
+double run(const std::vector<Point>& v, unsigned int threads)
+{
+  std::chrono::steady_clock::time_point start =
+    std::chrono::steady_clock::now();
+
+  SmartQuadtree<Point> q(.5, .5, .5, .5, 16, v.begin(), v.end(), threads);
+
+  return std::chrono::duration<double>(
+    std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char* argv[])
+{
+  std::size_t n = (argc > 1 ? atol(argv[1]) : 10000000);
+  unsigned int max = (argc > 2 ? atoi(argv[2]) :
+                      std::thread::hardware_concurrency());
+  if (max == 0) max = 1;
+  size_limit = 1e-4 + FLT_EPSILON;
+
+  std::vector<Point> v;
+  for (std::size_t i = 0; i < n; ++i) v.push_back(Point(uniform(), uniform()));
+
+  std::cout << "   threads    points    time (s)   speedup" << std::endl;
+  double reference = run(v, 1);
+  for (unsigned int t = 1; t <= max; ++t)
+  {
+    double elapsed = (t == 1 ? reference : run(v, t));
+    std::cout << std::setw(10) << t << std::setw(10) << n <<
+      std::setw(12) << std::fixed << std::setprecision(3) << elapsed <<
+      std::setw(10) << std::setprecision(2) << reference / elapsed <<
+      std::endl;
+  }
+
+  return EXIT_SUCCESS;
+}
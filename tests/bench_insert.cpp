@@ -0,0 +1,90 @@
+/*
+ * Timings for loading points in a quadtree, one by one or all at once.
+ *
+ * The loading time per point should only grow with the depth of the tree,
+ * i.e. logarithmically, both for uniform and for clustered data. The map of
+ * who is where, which grows with the number of points and misses the caches
+ * once larger than them, is not built by insertions (see removeData()).
+ */
+
+#include <cfloat>
+#include <cmath>
+#include <cstdlib>
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+#include "bench.h"
+
+// A few dense clusters, with a normal distribution around their centre
+void clustered(std::vector<Point>& v, std::size_t n)
+{
+  const int nb_clusters = 16;
+  float cx[nb_clusters], cy[nb_clusters];
+  for (int i = 0; i < nb_clusters; ++i)
+  { cx[i] = 0.1 + 0.8 * uniform(); cy[i] = 0.1 + 0.8 * uniform(); }
+  while (v.size() < n)
+  {
+    int c = rand() % nb_clusters;
+    float r = 0.02 * sqrt(-2. * log(uniform() + FLT_EPSILON));
+    float t = 2 * M_PI * uniform();
+    float x = cx[c] + r * cos(t), y = cy[c] + r * sin(t);
+    if (x > 0 && x < 1 && y > 0 && y < 1) v.push_back(Point(x, y));
+  }
+}
+
+void run(const char* name, const std::vector<Point>& v, std::size_t n)
+{
+  std::chrono::steady_clock::time_point start =
+    std::chrono::steady_clock::now();
+
+  SmartQuadtree<Point> q(.5, .5, .5, .5, 16);
+  for (std::size_t i = 0; i < n; ++i) q.insert(v[i]);
+
+  double elapsed = std::chrono::duration<double>(
+    std::chrono::steady_clock::now() - start).count();
+
+  std::cout << std::setw(10) << name << std::setw(8) << "insert" <<
+    std::setw(10) << n <<
+    std::setw(8) << (int) q.getDepth() <<
+    std::setw(12) << std::fixed << std::setprecision(3) << elapsed <<
+    std::setw(10) << std::setprecision(1) << elapsed * 1e9 / n << std::endl;
+}
+
+void bulk(const char* name, const std::vector<Point>& v, std::size_t n)
+{
+  std::chrono::steady_clock::time_point start =
+    std::chrono::steady_clock::now();
+
+  SmartQuadtree<Point> q(.5, .5, .5, .5, 16, v.begin(), v.begin() + n);
+
+  double elapsed = std::chrono::duration<double>(
+    std::chrono::steady_clock::now() - start).count();
+
+  std::cout << std::setw(10) << name << std::setw(8) << "bulk" <<
+    std::setw(10) << n <<
+    std::setw(8) << (int) q.getDepth() <<
+    std::setw(12) << std::fixed << std::setprecision(3) << elapsed <<
+    std::setw(10) << std::setprecision(1) << elapsed * 1e9 / n << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+  std::size_t n = (argc > 1 ? atol(argv[1]) : 1000000);
+  size_limit = 1e-3 + FLT_EPSILON;
+
+  std::vector<Point> uni, clu;
+  for (std::size_t i = 0; i < n; ++i) uni.push_back(Point(uniform(), uniform()));
+  clustered(clu, n);
+
+  std::cout << "      data  method    points   depth    time (s)  ns/point" <<
+    std::endl;
+  for (std::size_t k = n / 8; k <= n; k *= 2) bulk("uniform", uni, k);
+  for (std::size_t k = n / 8; k <= n; k *= 2) bulk("clustered", clu, k);
+  for (std::size_t k = n / 8; k <= n; k *= 2) run("uniform", uni, k);
+  for (std::size_t k = n / 8; k <= n; k *= 2) run("clustered", clu, k);
+
+  return EXIT_SUCCESS;
+}
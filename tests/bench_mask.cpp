@@ -0,0 +1,134 @@
+/*
+ * Timings for testing data against sector polygons:
+ * PolygonMask::pointInPolygon() on each data against pointsInPolygon() on
+ * blocks of data as large as leaves (sectors from 18 vertices on are cut in
+ * slabs), then sweeps of a quadtree masked by a small sector, before and
+ * after the coverage of quadrants is cached, against rectangle, radius and
+ * corridor queries over the same area.
+ */
+
+#include <cmath>
+#include <cstdlib>
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+#include "bench.h"
+
+// Returns the time for a sweep over q, masked if mask is not NULL
+double sweep(SmartQuadtree<Point>& q, PolygonMask* mask, std::size_t& count)
+{
+  std::chrono::steady_clock::time_point start =
+    std::chrono::steady_clock::now();
+
+  count = 0;
+  SmartQuadtree<Point>::const_iterator it =
+    (mask != NULL ? q.masked(mask).begin() : q.begin());
+  for ( ; it != q.end(); ++it) ++count;
+
+  return std::chrono::duration<double>(
+    std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char* argv[])
+{
+  std::size_t n = (argc > 1 ? atol(argv[1]) : 1000000);
+  std::size_t block = (argc > 2 ? atol(argv[2]) : 16);
+  if (block == 0) block = 1;
+
+  std::vector<float> x, y;
+  for (std::size_t i = 0; i < n; ++i)
+  {
+    x.push_back(2 * uniform() - 1);
+    y.push_back(2 * uniform() - 1);
+  }
+  std::vector<char> inside(n);
+
+  std::cout << "  vertices    scalar (ms)   batch (ms)   speedup" << std::endl;
+  for (int arc = 4; arc <= 1024; arc *= 4)
+  {
+    // Sector of the unit circle over a quarter turn
+    std::vector<float> polyX(1, 0.), polyY(1, 0.);
+    for (int i = 0; i <= arc; ++i)
+    {
+      polyX.push_back(cos(i * M_PI / (2 * arc)));
+      polyY.push_back(sin(i * M_PI / (2 * arc)));
+    }
+    PolygonMask m(polyX, polyY, arc + 2);
+
+    std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < n; ++i)
+      inside[i] = m.pointInPolygon(x[i], y[i]);
+    double scalar = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+
+    start = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < n; i += block)
+      m.pointsInPolygon(&x[i], &y[i], (n - i < block ? n - i : block),
+                        &inside[i]);
+    double batch = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+
+    std::cout << std::setw(10) << arc + 2 << std::setw(15) << std::fixed <<
+      std::setprecision(3) << scalar * 1e3 << std::setw(13) << batch * 1e3 <<
+      std::setw(10) << std::setprecision(2) << scalar / batch << std::endl;
+  }
+
+  std::vector<Point> v;
+  for (std::size_t i = 0; i < n; ++i) v.push_back(Point(x[i], y[i]));
+  SmartQuadtree<Point> q(0, 0, 1, 1, 16, v.begin(), v.end());
+
+  // Sector covering 5% of the area
+  std::vector<float> polyX(1, 0.), polyY(1, 0.);
+  for (int i = 0; i <= 64; ++i)
+  {
+    polyX.push_back(cos(i * M_PI / 128) / 2);
+    polyY.push_back(sin(i * M_PI / 128) / 2);
+  }
+  PolygonMask m(polyX, polyY, 66);
+
+  std::cout << std::endl << "     sweep    time (ms)     data" << std::endl;
+  std::size_t count;
+  double elapsed = sweep(q, NULL, count);
+  std::cout << std::setw(10) << "all" << std::setw(13) << std::setprecision(3)
+    << elapsed * 1e3 << std::setw(9) << count << std::endl;
+  for (int i = 0; i < 2; ++i)
+  {
+    elapsed = sweep(q, &m, count);
+    std::cout << std::setw(10) << (i == 0 ? "masked" : "cached") <<
+      std::setw(13) << elapsed * 1e3 << std::setw(9) << count << std::endl;
+  }
+
+  // Square and disc of the same area as the sector
+  std::vector<const Point*> out;
+  out.reserve(n / 10);
+  std::chrono::steady_clock::time_point start =
+    std::chrono::steady_clock::now();
+  q.queryRect(Boundary(.3, .3, sqrt(M_PI) / 8, sqrt(M_PI) / 8), out);
+  elapsed = std::chrono::duration<double>(
+    std::chrono::steady_clock::now() - start).count();
+  std::cout << std::setw(10) << "rect" << std::setw(13) << elapsed * 1e3 <<
+    std::setw(9) << out.size() << std::endl;
+
+  out.clear();
+  start = std::chrono::steady_clock::now();
+  q.queryRadius(.3, .3, .25, out);
+  elapsed = std::chrono::duration<double>(
+    std::chrono::steady_clock::now() - start).count();
+  std::cout << std::setw(10) << "radius" << std::setw(13) << elapsed * 1e3 <<
+    std::setw(9) << out.size() << std::endl;
+
+  // Corridor 0.1 wide along a segment of length 1.9
+  out.clear();
+  start = std::chrono::steady_clock::now();
+  q.queryCorridor(-.9, -.6, .9, 0., .05, out);
+  elapsed = std::chrono::duration<double>(
+    std::chrono::steady_clock::now() - start).count();
+  std::cout << std::setw(10) << "corridor" << std::setw(13) << elapsed * 1e3
+    << std::setw(9) << out.size() << std::endl;
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,56 @@
+/*
+ * Timings for k nearest neighbour searches: each position searched on its
+ * own with nearest(), against all positions searched at once, in random
+ * order or after a sort, with the batch variant of nearest().
+ */
+
+#include <cstdlib>
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+#include "bench.h"
+
+int main(int argc, char* argv[])
+{
+  std::size_t n = (argc > 1 ? atol(argv[1]) : 1000000);
+  std::size_t queries = (argc > 2 ? atol(argv[2]) : 100000);
+
+  std::vector<Point> v;
+  for (std::size_t i = 0; i < n; ++i)
+    v.push_back(Point(2 * uniform() - 1, 2 * uniform() - 1));
+  SmartQuadtree<Point> q(0, 0, 1, 1, 16, v.begin(), v.end());
+
+  std::vector<float> x, y;
+  for (std::size_t i = 0; i < queries; ++i)
+  {
+    x.push_back(2 * uniform() - 1);
+    y.push_back(2 * uniform() - 1);
+  }
+
+  std::cout << "         k    single (ms)   batch (ms)   speedup" << std::endl;
+  for (std::size_t k = 1; k <= 64; k *= 4)
+  {
+    std::vector<const Point*> out, all;
+
+    std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < queries; ++i)
+      q.nearest(x[i], y[i], k, out);
+    double single = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+
+    start = std::chrono::steady_clock::now();
+    q.nearest(&x[0], &y[0], queries, k, all);
+    double batch = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+
+    std::cout << std::setw(10) << k << std::setw(15) << std::fixed <<
+      std::setprecision(3) << single * 1e3 << std::setw(13) << batch * 1e3 <<
+      std::setw(10) << std::setprecision(2) << single / batch << std::endl;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,113 @@
+/*
+ * Timings for enumerating pairs of neighbours on the workload of test_simu:
+ * const_iterator::forward_begin() against forEachNeighbourPair(), and
+ * pairsWithin() yielding only the pairs closer than 4.
+ */
+
+#include <cfloat>
+#include <cstdlib>
+
+#include <chrono>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+#include "bench.h"
+
+const float width = 900, height = 600;
+
+struct Close {
+  unsigned long checks, close;
+  Close() : checks(0), close(0) {}
+  void operator()(const Point* a, const Point* b)
+  { ++checks; if (a->distance2(*b) < 16.) ++close; }
+};
+
+template<typename Quadtree>
+double iterator(const Quadtree& q, Close& c, unsigned int rounds)
+{
+  std::chrono::steady_clock::time_point start =
+    std::chrono::steady_clock::now();
+
+  for (unsigned int r = 0; r < rounds; ++r)
+  {
+    typename SmartQuadtree<Point>::const_iterator j = q.begin();
+    for ( ; j != q.end(); ++j)
+    {
+      std::vector<const Point*>::const_iterator k = j.forward_begin();
+      for ( ; k != j.forward_end(); ++k) c(&(*j), *k);
+    }
+  }
+
+  return std::chrono::duration<double>(
+    std::chrono::steady_clock::now() - start).count() / rounds;
+}
+
+template<typename Quadtree>
+double visitor(const Quadtree& q, Close& c, unsigned int rounds)
+{
+  std::chrono::steady_clock::time_point start =
+    std::chrono::steady_clock::now();
+
+  for (unsigned int r = 0; r < rounds; ++r)
+    q.forEachNeighbourPair(std::ref(c), 1);
+
+  return std::chrono::duration<double>(
+    std::chrono::steady_clock::now() - start).count() / rounds;
+}
+
+template<typename Quadtree>
+double within(const Quadtree& q, Close& c, unsigned int rounds)
+{
+  std::chrono::steady_clock::time_point start =
+    std::chrono::steady_clock::now();
+
+  for (unsigned int r = 0; r < rounds; ++r)
+    q.pairsWithin(4., std::ref(c), 1);
+
+  return std::chrono::duration<double>(
+    std::chrono::steady_clock::now() - start).count() / rounds;
+}
+
+void report(const char* method, const char* mask, double elapsed,
+            const Close& c)
+{
+  std::cout << std::setw(10) << method << std::setw(8) << mask <<
+    std::setw(12) << std::fixed << std::setprecision(3) << elapsed * 1e3 <<
+    std::setw(12) << c.checks << std::setw(10) << c.close << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+  std::size_t n = (argc > 1 ? atol(argv[1]) : 20000);
+  unsigned int rounds = (argc > 2 ? atoi(argv[2]) : 20);
+  if (rounds == 0) rounds = 1;
+  size_limit = 16. + FLT_EPSILON;
+
+  SmartQuadtree<Point> q(width / 2, height / 2, width / 2, height / 2, 16);
+  for (std::size_t i = 0; i < n; ++i)
+    q.insert(Point(uniform() * width, uniform() * height));
+
+  std::vector<float> polyX, polyY;
+  polyX.push_back(225); polyX.push_back(225); polyX.push_back(450);
+  polyX.push_back(675); polyX.push_back(450);
+  polyY.push_back(150); polyY.push_back(300); polyY.push_back(450);
+  polyY.push_back(450); polyY.push_back(150);
+  PolygonMask mask(polyX, polyY, 5);
+
+  std::cout << "    method    mask   time (ms)      checks     close" <<
+    std::endl;
+
+  Close c1, c2, c3, c4, c5, c6;
+  report("iterator", "no", iterator(q, c1, rounds), c1);
+  report("visitor", "no", visitor(q, c2, rounds), c2);
+  report("within", "no", within(q, c3, rounds), c3);
+  report("iterator", "yes", iterator(q.masked(&mask), c4, rounds), c4);
+  report("visitor", "yes", visitor(q.masked(&mask), c5, rounds), c5);
+  report("within", "yes", within(q.masked(&mask), c6, rounds), c6);
+
+  return (c1.checks == c2.checks && c1.close == c3.close &&
+          c4.checks == c5.checks && c4.close == c6.close ?
+          EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,252 @@
+/*
+ * Headless version of test_simu: points move and bounce in a 900x600 box,
+ * pairs of neighbours closer than 4 are detected, and points inside the
+ * same polygon as test_simu are parsed at each frame.
+ *
+ * Each phase of each frame is timed apart:
+ *  - move:   relocation sweep with the mutable iterator,
+ *  - pairs:  pairs of neighbours through const_iterator::forward_begin(),
+ *  - masked: sweep of the points inside the polygon.
+ * Percentiles of the timings are printed in JSON (or CSV), with the
+ * throughput of each phase in items per second at the median.
+ *
+ * bench_simu [--points=20000] [--frames=200] [--warmup=10] [--speed=1]
+ *            [--capacity=16] [--mask=1] [--seed=1] [--format=json|csv]
+ */
+
+#include <cfloat>
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "bench.h"
+
+const float width = 900, height = 600;
+
+// Point of test_simu, moving at its own speed
+struct Mobile : Point {
+
+  float vx, vy;
+  mutable bool draw, green;
+
+  Mobile(float x, float y, float speed) :
+    Point(x, y), draw(false), green(false)
+  {
+    vx = (uniform() - 0.5) * speed;
+    vy = (uniform() - 0.5) * speed;
+  }
+
+  void iterate() {
+    x += vx;
+    y += vy;
+    if (x < 0) { x = -x; vx = -vx; }
+    if (y < 0) { y = -y; vy = -vy; }
+    if (x > width) { vx = -vx; x += vx; }
+    if (y > height) { vy = -vy; y += vy; }
+    draw = false;
+  }
+
+};
+
+template<>
+struct BucketType<Mobile>
+{
+  typedef Bucket<Mobile> type;
+};
+
+struct Options {
+  unsigned long points, frames, warmup, capacity, seed;
+  float speed;
+  bool mask, csv;
+
+  Options() : points(20000), frames(200), warmup(10), capacity(16), seed(1),
+              speed(1.), mask(true), csv(false) {}
+
+  // Returns false on an unknown option
+  bool parse(const char* arg)
+  {
+    const char* value = strchr(arg, '=');
+    if (strncmp(arg, "--", 2) != 0 || value == NULL) return false;
+    std::string key(arg + 2, value++);
+    if (key == "points") points = atol(value);
+    else if (key == "frames") frames = atol(value);
+    else if (key == "warmup") warmup = atol(value);
+    else if (key == "capacity") capacity = atol(value);
+    else if (key == "seed") seed = atol(value);
+    else if (key == "speed") speed = atof(value);
+    else if (key == "mask") mask = (atoi(value) != 0);
+    else if (key == "format" && !strcmp(value, "csv")) csv = true;
+    else if (key == "format" && !strcmp(value, "json")) csv = false;
+    else return false;
+    return true;
+  }
+};
+
+// Timings of one phase over all frames, and the number of items (points
+// or pairs) it processed at each frame
+struct Phase {
+  const char* name;
+  std::vector<double> seconds;
+  std::vector<unsigned long> items;
+
+  Phase(const char* name) : name(name) {}
+
+  // Time at quantile p in [0, 1], nearest rank
+  double quantile(double p) const
+  {
+    std::vector<double> sorted(seconds);
+    std::sort(sorted.begin(), sorted.end());
+    std::size_t rank = static_cast<std::size_t>(p * (sorted.size() - 1) + .5);
+    return sorted[rank];
+  }
+
+  double mean() const
+  {
+    double sum = 0;
+    for (std::size_t i = 0; i < seconds.size(); ++i) sum += seconds[i];
+    return sum / seconds.size();
+  }
+
+  unsigned long medianItems() const
+  {
+    std::vector<unsigned long> sorted(items);
+    std::sort(sorted.begin(), sorted.end());
+    return sorted[sorted.size() / 2];
+  }
+};
+
+typedef std::chrono::steady_clock Clock;
+
+double since(const Clock::time_point& start)
+{ return std::chrono::duration<double>(Clock::now() - start).count(); }
+
+void report(const Options& o, const std::vector<Phase>& phases)
+{
+  static const double quantiles[] = { .5, .9, .99, 1. };
+  static const char* names[] = { "p50", "p90", "p99", "max" };
+
+  std::cout << std::setprecision(6);
+  if (o.csv)
+  {
+    std::cout << "phase,points,capacity,speed,mask,frames,items," <<
+      "mean_ms,p50_ms,p90_ms,p99_ms,max_ms,items_per_s" << std::endl;
+    for (std::size_t i = 0; i < phases.size(); ++i)
+    {
+      const Phase& p = phases[i];
+      std::cout << p.name << "," << o.points << "," << o.capacity << "," <<
+        o.speed << "," << o.mask << "," << p.seconds.size() << "," <<
+        p.medianItems() << "," << p.mean() * 1e3;
+      for (int k = 0; k < 4; ++k)
+        std::cout << "," << p.quantile(quantiles[k]) * 1e3;
+      std::cout << "," << p.medianItems() / p.quantile(.5) << std::endl;
+    }
+    return;
+  }
+
+  std::cout << "{" << std::endl <<
+    "  \"points\": " << o.points << "," << std::endl <<
+    "  \"capacity\": " << o.capacity << "," << std::endl <<
+    "  \"speed\": " << o.speed << "," << std::endl <<
+    "  \"mask\": " << (o.mask ? "true" : "false") << "," << std::endl <<
+    "  \"frames\": " << o.frames << "," << std::endl <<
+    "  \"phases\": {" << std::endl;
+  for (std::size_t i = 0; i < phases.size(); ++i)
+  {
+    const Phase& p = phases[i];
+    std::cout << "    \"" << p.name << "\": { \"items\": " <<
+      p.medianItems() << ", \"mean_ms\": " << p.mean() * 1e3;
+    for (int k = 0; k < 4; ++k)
+      std::cout << ", \"" << names[k] << "_ms\": " <<
+        p.quantile(quantiles[k]) * 1e3;
+    std::cout << ", \"items_per_s\": " << p.medianItems() / p.quantile(.5) <<
+      " }" << (i + 1 < phases.size() ? "," : "") << std::endl;
+  }
+  std::cout << "  }" << std::endl << "}" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+  Options o;
+  for (int i = 1; i < argc; ++i)
+    if (!o.parse(argv[i]))
+    {
+      std::cerr << "unknown option: " << argv[i] << std::endl;
+      return EXIT_FAILURE;
+    }
+  if (o.frames == 0) o.frames = 1;
+  srand(o.seed);
+  size_limit = 16. + FLT_EPSILON;
+
+  SmartQuadtree<Mobile> q(width / 2, height / 2, width / 2, height / 2,
+                          o.capacity);
+  for (unsigned long i = 0; i < o.points; ++i)
+    q.insert(Mobile(uniform() * width, uniform() * height, o.speed));
+
+  std::vector<float> polyX, polyY;
+  polyX.push_back(225); polyX.push_back(225); polyX.push_back(450);
+  polyX.push_back(675); polyX.push_back(450);
+  polyY.push_back(150); polyY.push_back(300); polyY.push_back(450);
+  polyY.push_back(450); polyY.push_back(150);
+  PolygonMask mask(polyX, polyY, 5);
+
+  std::vector<Phase> phases;
+  phases.push_back(Phase("move"));
+  phases.push_back(Phase("pairs"));
+  if (o.mask) phases.push_back(Phase("masked"));
+
+  for (unsigned long f = 0; f < o.warmup + o.frames; ++f)
+  {
+    bool record = (f >= o.warmup);
+    unsigned long count = 0;
+
+    Clock::time_point start = Clock::now();
+    SmartQuadtree<Mobile>::iterator it = q.begin();
+    for ( ; it != q.end(); ++it, ++count)
+      it->iterate();
+    if (record)
+    {
+      phases[0].seconds.push_back(since(start));
+      phases[0].items.push_back(count);
+    }
+
+    count = 0;
+    start = Clock::now();
+    SmartQuadtree<Mobile>::const_iterator j = q.begin();
+    for ( ; j != q.end(); ++j)
+    {
+      std::vector<const Mobile*>::const_iterator k = j.forward_begin();
+      for ( ; k != j.forward_end(); ++k, ++count)
+        if (j->distance2(**k) < 16.)
+        {
+          j->draw = true;
+          (*k)->draw = true;
+        }
+    }
+    if (record)
+    {
+      phases[1].seconds.push_back(since(start));
+      phases[1].items.push_back(count);
+    }
+
+    if (!o.mask) continue;
+    count = 0;
+    start = Clock::now();
+    j = q.masked(&mask).begin();
+    for ( ; j != q.end(); ++j, ++count)
+      j->green = true;
+    if (record)
+    {
+      phases[2].seconds.push_back(since(start));
+      phases[2].items.push_back(count);
+    }
+  }
+
+  report(o, phases);
+  return EXIT_SUCCESS;
+}
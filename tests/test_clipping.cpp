@@ -1,3 +1,5 @@
+#include <cmath>
+
 #include "quadtree.h"
 #include "logger.h"
 
@@ -115,6 +117,145 @@ void Test_PolygonMask::RunTest_PolygonMask(Logger& log)
     log.testint(__LINE__, clip.polyY[3], 150.,  "clip.polyY[3]");
   }
 
+  {
+    log.message(__LINE__, "Test of points in polygon, tested in batch");
+    std::vector<float> polyX, polyY;
+
+    // Sector of a circle, with points on the border of the lattice below
+    polyX.push_back(0.); polyY.push_back(0.);
+    for (int i = 0; i <= 12; ++i)
+    {
+      polyX.push_back(8. * cos(i * M_PI / 24.));
+      polyY.push_back(8. * sin(i * M_PI / 24.));
+    }
+
+    PolygonMask m(polyX, polyY, 14);
+
+    // Sizes not multiple of 4 or 8 go through the scalar tail
+    std::vector<float> x, y;
+    for (int i = -10; i <= 10; ++i)
+      for (int j = -10; j <= 10; ++j)
+      {
+        x.push_back(i * .5); y.push_back(j * .5);
+        x.push_back(i * .5 + .1); y.push_back(j * .5 - .3);
+      }
+
+    std::vector<char> inside(x.size());
+    m.pointsInPolygon(&x[0], &y[0], x.size(), &inside[0]);
+    int diff = 0, count = 0;
+    for (size_t i = 0; i < x.size(); ++i)
+    {
+      if (inside[i] != m.pointInPolygon(x[i], y[i])) ++diff;
+      if (inside[i]) ++count;
+    }
+    log.testint(__LINE__, diff, 0, "batch and scalar differ");
+    log.testint(__LINE__, count > 0 && count < (int) x.size(), 1,
+                "some points inside");
+  }
+
+  {
+    log.message(__LINE__, "Test of a polygon with a hole and two parts");
+    std::vector<std::vector<float> > ringsX(3), ringsY(3);
+    float squareX[] = { -8., 8., 8., -8. }, squareY[] = { -8., -8., 8., 8. };
+    float holeX[] = { -4., -4., 4., 4. }, holeY[] = { -4., 4., 4., -4. };
+    float partX[] = { 12., 18., 15. }, partY[] = { 0., 0., 5. };
+    ringsX[0].assign(squareX, squareX + 4);
+    ringsY[0].assign(squareY, squareY + 4);
+    ringsX[1].assign(holeX, holeX + 4);
+    ringsY[1].assign(holeY, holeY + 4);
+    ringsX[2].assign(partX, partX + 3);
+    ringsY[2].assign(partY, partY + 3);
+
+    PolygonMask m(ringsX, ringsY);
+    log.testint(__LINE__, m.getRings(), 3, "m.getRings()");
+    log.testint(__LINE__, m.getSize(), 11, "m.getSize()");
+    log.testint(__LINE__, m.pointInPolygon(-6., 1.), 1, "in the square");
+    log.testint(__LINE__, m.pointInPolygon(1., 1.), 0, "in the hole");
+    log.testint(__LINE__, m.pointInPolygon(15., 1.), 1, "in the other part");
+    log.testint(__LINE__, m.pointInPolygon(10., 1.), 0, "between parts");
+
+    log.testint(__LINE__, m.classify(Boundary(0., 0., 2., 2.)), OUTSIDE,
+                "box in the hole");
+    log.testint(__LINE__, m.classify(Boundary(6., 0., 1., 1.)), INSIDE,
+                "box around the hole");
+    log.testint(__LINE__, m.classify(Boundary(4., 0., 1., 1.)), PARTIAL,
+                "box over the border of the hole");
+
+    // The hole is kept in the box, the other part is left out
+    PolygonMask clip = m.clip(Boundary(0., 0., 6., 6.));
+    log.testint(__LINE__, clip.getRings(), 2, "clip.getRings()");
+    log.testint(__LINE__, clip.pointInPolygon(5., 1.), 1,
+                "clip, in the square");
+    log.testint(__LINE__, clip.pointInPolygon(1., 1.), 0, "clip, in the hole");
+    clip = m.clip(Boundary(6.5, 0., 1., 1.));
+    log.testint(__LINE__, clip.getRings(), 1, "clip.getRings() off the hole");
+
+    // Clipping into buffers gives the same vertices, and allocates nothing
+    // when they are reused
+    PolygonMask::Clipped out;
+    Boundary box(0., 0., 6., 6.);
+    clip = m.clip(box);
+    log.testint(__LINE__, m.clip(box, out), clip.getSize(), "clip into out");
+    log.testint(__LINE__, out.rings.size(), 3, "out.rings.size()");
+    log.testint(__LINE__, out.x == clip.polyX && out.y == clip.polyY, 1,
+                "same vertices in out");
+    const float* data = out.x.data();
+    std::size_t capacity = out.x.capacity();
+    m.clip(Boundary(6.5, 0., 1., 1.), out);
+    m.clip(box, out);
+    log.testint(__LINE__, out.x.data() == data &&
+                out.x.capacity() == capacity, 1, "out reused");
+  }
+
+  {
+    log.message(__LINE__, "Test of a large polygon tested by slabs");
+    std::vector<std::vector<float> > ringsX(2), ringsY(2);
+
+    // Star with a star-shaped hole, the latter turning the other way round
+    for (int i = 0; i < 60; ++i)
+    {
+      double r = (i % 2 ? 9. : 6.), a = i * M_PI / 30.;
+      ringsX[0].push_back(r * cos(a)); ringsY[0].push_back(r * sin(a));
+      r = (i % 2 ? 4. : 2.);
+      ringsX[1].push_back(r * cos(-a + .05));
+      ringsY[1].push_back(r * sin(-a + .05));
+    }
+    PolygonMask m(ringsX, ringsY);
+
+    // Points off the edges, checked against the even-odd rule over all edges
+    std::vector<float> x, y;
+    for (int i = -50; i <= 50; ++i)
+      for (int j = -50; j <= 50; ++j)
+      {
+        x.push_back(i * .2 + .0137); y.push_back(j * .2 + .0071);
+      }
+
+    std::vector<char> inside(x.size());
+    m.pointsInPolygon(&x[0], &y[0], x.size(), &inside[0]);
+    int diff = 0, batch = 0, count = 0;
+    for (size_t i = 0; i < x.size(); ++i)
+    {
+      bool odd = false;
+      for (size_t r = 0; r < ringsX.size(); ++r)
+        for (size_t e = 0, f = ringsX[r].size() - 1;
+             e < ringsX[r].size(); f = e++)
+        {
+          double xe = ringsX[r][e], ye = ringsY[r][e];
+          double xf = ringsX[r][f], yf = ringsY[r][f];
+          if ((ye < y[i]) != (yf < y[i]) &&
+              xe + (y[i] - ye) / (yf - ye) * (xf - xe) < x[i])
+            odd = !odd;
+        }
+      if (m.pointInPolygon(x[i], y[i]) != odd) ++diff;
+      if (inside[i] != m.pointInPolygon(x[i], y[i])) ++batch;
+      if (odd) ++count;
+    }
+    log.testint(__LINE__, diff, 0, "slabs and all edges differ");
+    log.testint(__LINE__, batch, 0, "batch and scalar differ");
+    log.testint(__LINE__, count > 0 && count < (int) x.size(), 1,
+                "some points inside");
+  }
+
 }
 
 int main()
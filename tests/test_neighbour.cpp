@@ -1,5 +1,8 @@
+#include <algorithm>
 #include <cstdio>
 #include <cstdlib>
+#include <random>
+#include <vector>
 
 #include "logger.h"
 #include "neighbour.h"
@@ -66,6 +69,47 @@ int main() {
   log.testint(__LINE__, Neighbour::samelevel(1, EAST, 1), 4,
               "samelevel(1, EAST, 1)");
 
+  log.message(__LINE__, "");
+  log.message(__LINE__, "Tests at the deepest level, for all directions");
+
+  // Same masks whatever the level: no state between calls
+  const int dx[8] = { 1, 1, 0, -1, -1, -1,  0,  1 };
+  const int dy[8] = { 0, 1, 1,  1,  0, -1, -1, -1 };
+  const unsigned int cells[4][2] = {
+    { 0x7fff, 0x8000 }, { 0x1234, 0xfedc },
+    { 0x0001, 0x00ff }, { 0xaaaa, 0x5555 }
+  };
+  int mismatch = 0;
+  for (int i = 0; i < 4; ++i)
+    for (unsigned int dir = 0; dir < 8; ++dir)
+      if (Neighbour::samelevel(Neighbour::interleave(cells[i][0], cells[i][1]),
+                               dir, Neighbour::codelevels) !=
+          Neighbour::interleave(cells[i][0] + dx[dir], cells[i][1] + dy[dir]))
+        ++mismatch;
+  log.testint(__LINE__, mismatch, 0, "samelevel(interleave(x, y), dir, 16)");
+
+  log.message(__LINE__, "");
+  log.message(__LINE__, "Tests of sorting location codes");
+
+  // Few distinct codes, so that stability matters; clusters share their
+  // most significant byte
+  typedef std::pair<unsigned int, std::size_t> Code;
+  std::minstd_rand random(7);
+  std::vector<Code> codes;
+  for (std::size_t i = 0; i < 100000; ++i)
+    codes.push_back(Code((random() % 4 == 0 ? 0x3a000000u : 0u) |
+                         (random() % 5000) * 0x10101u, i));
+  std::vector<Code> expected(codes);
+  std::stable_sort(expected.begin(), expected.end(),
+                   [](const Code& a, const Code& b)
+                   { return a.first < b.first; });
+  for (unsigned int threads = 1; threads <= 4; threads += 3)
+  {
+    std::vector<Code> sorted(codes);
+    Neighbour::sort(sorted, threads);
+    log.testint(__LINE__, sorted == expected, 1, "Neighbour::sort(codes)");
+  }
+
   return log.reportexit();
 
 }
@@ -1,13 +1,44 @@
 #include "quadtree.h"
 #include "logger.h"
 
+#include <atomic>
 #include <cfloat> // FLT_EPSILON
+#include <cstdint> // uintptr_t
+#include <functional>
+#include <random>
+#include <set>
 
 struct Point {
   float x, y;
   Point(float x, float y) : x(x), y(y) {}
 };
 
+template<>
+struct TypeDescriptor<Point*>
+{
+  typedef Point* pointer;
+  typedef const Point* const_pointer;
+  static pointer getPtr(Point* const& p) { return p; }
+};
+
+template<>
+struct BoundaryXY<Point*>
+{
+  static double getX(Point* const& p) { return p->x; }
+  static double getY(Point* const& p) { return p->y; }
+};
+
+// Same as Point, stored in flat buckets
+struct FlatPoint : Point {
+  FlatPoint(float x, float y) : Point(x, y) {}
+};
+
+template<>
+struct BucketType<FlatPoint>
+{
+  typedef Bucket<FlatPoint> type;
+};
+
 template<>
 bool BoundaryLimit<Boundary>::limitation(const Boundary& b)
 { return (b.norm_l1() < (1 + FLT_EPSILON)); }
@@ -18,6 +49,16 @@ std::ostream& operator<<(std::ostream& os, const Point& p)
   return os;
 }
 
+// Returns n points spread over (-3.9, 3.9) x (-3.9, 3.9), always the same
+std::vector<Point> scattered(int n)
+{
+  std::vector<Point> points;
+  for (int i = 0; i < n; ++i)
+    points.push_back(Point(-3.9 + 7.8 * ((i * 37) % 101) / 101.,
+                           -3.9 + 7.8 * ((i * 53) % 97) / 97.));
+  return points;
+}
+
 template<>
 std::ostream& operator<<(std::ostream& os, const SmartQuadtree<Point>& e)
 {
@@ -27,19 +68,20 @@ std::ostream& operator<<(std::ostream& os, const SmartQuadtree<Point>& e)
   for (size_t i=0; i<e.level; ++i) os << "  ";
   os << "  " <<
     e.b.center_x << ", " << e.b.center_y <<
-    " (0x" << std::hex << e.location << ") #" << std::dec << e.level << " [" <<
-    e.delta[EAST] << "," << e.delta[NORTHEAST] << "," <<
-    e.delta[NORTH] << "," << e.delta[NORTHWEST] << "," <<
-    e.delta[WEST] << "," << e.delta[SOUTHWEST] << "," <<
-    e.delta[SOUTH] << "," << e.delta[SOUTHEAST] << "] -> ";
+    " (0x" << std::hex << e.location << ") #" << std::dec << (int) e.level << " [" <<
+    (int) e.delta[EAST] << "," << (int) e.delta[NORTHEAST] << "," <<
+    (int) e.delta[NORTH] << "," << (int) e.delta[NORTHWEST] << "," <<
+    (int) e.delta[WEST] << "," << (int) e.delta[SOUTHWEST] << "," <<
+    (int) e.delta[SOUTH] << "," << (int) e.delta[SOUTHEAST] << "] -> ";
 
-  std::list<Point>::const_iterator it = e.points.begin(), ie = e.points.end();
+  BucketType<Point>::type::const_iterator it = e.points.begin(),
+    ie = e.points.end();
   for ( ; it != ie; ++it) os << *it << " ";
   os << std::endl;
 
-  if (NULL != e.children[0])
-    os << *(e.children[0]) << *(e.children[1]) <<
-      *(e.children[2]) << *(e.children[3]);
+  if (NULL != e.children)
+    os << e.children[0] << e.children[1] <<
+      e.children[2] << e.children[3];
   for (size_t i=0; i<e.level; ++i) os << "  ";
 
   os << "}" << std::endl;
@@ -49,6 +91,26 @@ std::ostream& operator<<(std::ostream& os, const SmartQuadtree<Point>& e)
 class Test_SmartQuadtree {
 public:
   static void RunTest_SmartQuadtree(Logger& log) ;
+  static void RunTest_Iterator(Logger& log) ;
+  static void RunTest_Rebalance(Logger& log) ;
+  static void RunTest_Coarsen(Logger& log) ;
+  static void RunTest_Bulk(Logger& log) ;
+  static void RunTest_NeighbourPairs(Logger& log) ;
+  static void RunTest_MaskCoverage(Logger& log) ;
+  static void RunTest_RangeQueries(Logger& log) ;
+  static void RunTest_Nearest(Logger& log) ;
+  static void RunTest_Corridor(Logger& log) ;
+  static void RunTest_Stats(Logger& log) ;
+  static void RunTest_Stability(Logger& log) ;
+
+  // Fills a leaf at the limit over capacity, then empties half of it
+  template<typename P>
+  static void RunTest_OverCapacity(Logger& log, const char* name);
+
+  // Number of statistics of q which differ from a sweep over its leaves,
+  // counting the size of the map of who is where as one of them
+  template<typename T>
+  static int staleStats(const SmartQuadtree<T>& q);
 };
 
 void Test_SmartQuadtree::RunTest_SmartQuadtree(Logger& log)
@@ -227,9 +289,802 @@ void Test_SmartQuadtree::RunTest_SmartQuadtree(Logger& log)
               "q.getQuadrant(0x32,3)->delta[NORTHWEST]");
 }
 
+void Test_SmartQuadtree::RunTest_Iterator(Logger& log)
+{
+  log.message(__LINE__, "");
+  log.message(__LINE__, "Tests of the iterator with moving elements");
+
+  SmartQuadtree<Point> q(0., 0., 4., 4., 4);
+  for (int i = 0; i < 64; ++i)
+    q.insert(Point(-3.9 + (i % 8) * 0.5, -3.9 + (i / 8) * 0.5));
+
+  // Each element moves towards the south west, across many cells
+  int count = 0;
+  SmartQuadtree<Point>::iterator it = q.begin();
+  for ( ; it != q.end(); ++it, ++count)
+  {
+    it->x -= 3.3;
+    it->y -= 3.3;
+    if (it->x < -4.) it->x += 7.8;
+    if (it->y < -4.) it->y += 7.8;
+  }
+  log.testint(__LINE__, count, 64, "count (moving sweep)");
+
+  count = 0;
+  for (it = q.begin(); it != q.end(); ++it) ++count;
+  log.testint(__LINE__, count, 64, "count (still sweep)");
+
+  count = 0;
+  SmartQuadtree<Point>::const_iterator cit = q.begin();
+  for ( ; cit != q.end(); ++cit) ++count;
+  log.testint(__LINE__, count, 64, "count (const sweep)");
+}
+
+void Test_SmartQuadtree::RunTest_Rebalance(Logger& log)
+{
+  log.message(__LINE__, "");
+  log.message(__LINE__, "Tests of rebalance with elements moved from outside");
+
+  std::vector<Point> points;
+  for (int i = 0; i < 64; ++i)
+    points.push_back(Point(-3.9 + (i % 8), -3.9 + (i / 8)));
+
+  SmartQuadtree<Point*> q(0., 0., 4., 4., 4);
+  for (size_t i = 0; i < points.size(); ++i) q.insert(&points[i]);
+
+  log.testint(__LINE__, q.rebalance(), 0, "q.rebalance() (nothing moved)");
+
+  // Only elements in the south west quarter move to the north east
+  int moved = 0;
+  for (size_t i = 0; i < points.size(); ++i)
+    if (points[i].x < 0 && points[i].y < 0)
+    {
+      points[i].x += 4.; points[i].y += 4.;
+      ++moved;
+    }
+
+  log.testint(__LINE__, q.rebalance(), moved, "q.rebalance()");
+
+  int count = 0;
+  SmartQuadtree<Point*>::const_iterator it = q.begin();
+  for ( ; it != q.end(); ++it) ++count;
+  log.testint(__LINE__, count, 64, "count after rebalance");
+
+  // updateData returns true for elements out of their cell
+  int misplaced = 0;
+  for (size_t i = 0; i < points.size(); ++i)
+  {
+    Point* p = &points[i];
+    if (q.updateData(p)) ++misplaced;
+  }
+  log.testint(__LINE__, misplaced, 0, "elements out of their cell");
+  log.testint(__LINE__, q.rebalance(), 0, "q.rebalance() (again)");
+}
+
+void Test_SmartQuadtree::RunTest_Coarsen(Logger& log)
+{
+  log.message(__LINE__, "");
+  log.message(__LINE__, "Tests of coarsening");
+
+  std::vector<Point> points;
+  points.push_back(Point(1.  , 1.));
+  points.push_back(Point(1.  , 2.));
+  points.push_back(Point(-2. , 1.));
+  points.push_back(Point(0.  , 2.));
+  points.push_back(Point(0.1 , 2.));
+  points.push_back(Point(1.  , -1.));
+  points.push_back(Point(1.  , 3.));
+  points.push_back(Point(-2. , 2.));
+  points.push_back(Point(1.2 , 1.3));
+  points.push_back(Point(0.1 , 0.3));
+  points.push_back(Point(0.1 , 0.1));
+  points.push_back(Point(0.1 , 0.2));
+
+  // Same quadtree as in RunTest_SmartQuadtree
+  SmartQuadtree<Point*> q(0., 0., 4., 4., 4);
+  for (size_t i = 0; i < points.size(); ++i) q.insert(&points[i]);
+
+  log.testint(__LINE__, q.coarsen(), 0, "q.coarsen() (nothing removed)");
+  log.testint(__LINE__, q.getQuadrant(0x30, 3)->getLevel(), 3,
+              "q.getQuadrant(0x30, 3)->getLevel()");
+
+  // Quadrant 0xc now holds 4 elements
+  for (size_t i = 9; i < 12; ++i)
+  {
+    Point* p = &points[i];
+    q.removeData(p);
+  }
+
+  log.testint(__LINE__, q.coarsen(3), 0, "q.coarsen(3)");
+  log.testint(__LINE__, q.coarsen(4), 1, "q.coarsen(4)");
+
+  SmartQuadtree<Point*>* m = q.getQuadrant(0x30, 3);
+  log.testhex(__LINE__, m->getLocation(), 0xc, "m->getLocation()");
+  log.testint(__LINE__, m->getPoints().size(), 4, "m->getPoints().size()");
+
+  log.testint(__LINE__, m->delta[SOUTH], -1, "m->delta[SOUTH]");
+  log.testint(__LINE__, m->delta[WEST], -1, "m->delta[WEST]");
+  log.testint(__LINE__, m->delta[NORTH], 0, "m->delta[NORTH]");
+  log.testint(__LINE__, m->samelevel(NORTH)->delta[SOUTH], 0,
+              "m->samelevel(NORTH)->delta[SOUTH]");
+  log.testint(__LINE__, m->samelevel(EAST)->delta[WEST], 0,
+              "m->samelevel(EAST)->delta[WEST]");
+  log.testint(__LINE__, m->samelevel(NORTHEAST)->delta[SOUTHWEST], 0,
+              "m->samelevel(NORTHEAST)->delta[SOUTHWEST]");
+
+  // Deltas of all leaves match the structure of the tree
+  int mismatch = 0, count = 0;
+  std::list<SmartQuadtree<Point*>*>::iterator leaf;
+  for (leaf = q.tree->leaves.begin(); leaf != q.tree->leaves.end(); ++leaf)
+  {
+    for (unsigned char i = 0; i < 8; ++i)
+      if ((*leaf)->delta[i] != (*leaf)->computeDelta(i)) ++mismatch;
+    count += (*leaf)->getPoints().size();
+  }
+  log.testint(__LINE__, mismatch, 0, "deltas out of date");
+  log.testint(__LINE__, count, 9, "count after coarsening");
+
+  log.message(__LINE__, "");
+  log.message(__LINE__, "Tests of level differences after splitting again");
+
+  q.insert(&points[9]);
+  q.insert(&points[10]);
+  q.insert(&points[11]);
+
+  m = q.getQuadrant(0x30, 3);
+  log.testhex(__LINE__, m->getLocation(), 0x30, "m->getLocation()");
+  log.testint(__LINE__, m->delta[SOUTH], -2, "m->delta[SOUTH]");
+  log.testint(__LINE__, m->samelevel(SOUTH)->delta[NORTH], 1,
+              "m->samelevel(SOUTH)->delta[NORTH]");
+  log.testint(__LINE__, m->delta[WEST], -2, "m->delta[WEST]");
+  log.testint(__LINE__, m->delta[SOUTHWEST], -2, "m->delta[SOUTHWEST]");
+  log.testint(__LINE__, q.getQuadrant(0x31, 3)->delta[EAST], -1,
+              "q.getQuadrant(0x31, 3)->delta[EAST]");
+}
+
+void Test_SmartQuadtree::RunTest_Bulk(Logger& log)
+{
+  log.message(__LINE__, "");
+  log.message(__LINE__, "Tests of bulk loading");
+
+  // No point on the border of two quadrants
+  std::vector<Point> points;
+  for (int i = 0; i < 64; ++i)
+    points.push_back(Point(-3.9 + (i % 8), -3.9 + (i / 8)));
+  for (int i = 0; i < 16; ++i)
+    points.push_back(Point(0.3 + (i % 4) * 0.1, 0.3 + (i / 4) * 0.1));
+
+  SmartQuadtree<Point> q(0., 0., 4., 4., 4);
+  for (size_t i = 0; i < points.size(); ++i) q.insert(points[i]);
+  SmartQuadtree<Point> bulk(0., 0., 4., 4., 4, points.begin(), points.end());
+
+  // Same leaves, in the same order, with the same deltas
+  int mismatch = 0, count = 0;
+  std::list<SmartQuadtree<Point>*>::iterator l1 = q.tree->leaves.begin();
+  std::list<SmartQuadtree<Point>*>::iterator l2 = bulk.tree->leaves.begin();
+  for ( ; l1 != q.tree->leaves.end() && l2 != bulk.tree->leaves.end();
+        ++l1, ++l2)
+  {
+    if ((*l1)->location != (*l2)->location) ++mismatch;
+    if ((*l1)->points.size() != (*l2)->points.size()) ++mismatch;
+    for (unsigned char i = 0; i < 8; ++i)
+      if ((*l1)->delta[i] != (*l2)->delta[i]) ++mismatch;
+    count += (*l2)->points.size();
+  }
+  log.testint(__LINE__, mismatch, 0, "differences with insertion");
+  log.testint(__LINE__, l1 == q.tree->leaves.end(), 1, "number of leaves");
+  log.testint(__LINE__, l2 == bulk.tree->leaves.end(), 1, "number of leaves");
+  log.testint(__LINE__, count, 80, "count after bulk loading");
+  log.testint(__LINE__, bulk.getDepth(), q.getDepth(), "bulk.getDepth()");
+
+  // Subtrees built by several threads are put back in place
+  SmartQuadtree<Point> parallel(0., 0., 4., 4., 4,
+                                points.begin(), points.end(), 4);
+  mismatch = 0;
+  l1 = parallel.tree->leaves.begin();
+  l2 = bulk.tree->leaves.begin();
+  for ( ; l1 != parallel.tree->leaves.end() &&
+        l2 != bulk.tree->leaves.end(); ++l1, ++l2)
+  {
+    if ((*l1)->location != (*l2)->location) ++mismatch;
+    if ((*l1)->points.size() != (*l2)->points.size()) ++mismatch;
+    if ((*l1)->leaf != l1) ++mismatch;
+    for (unsigned char i = 0; i < 8; ++i)
+      if ((*l1)->delta[i] != (*l2)->delta[i]) ++mismatch;
+  }
+  log.testint(__LINE__, mismatch, 0, "differences with 4 threads");
+  log.testint(__LINE__, parallel.tree->leaves.size(),
+              bulk.tree->leaves.size(), "number of leaves with 4 threads");
+
+  // The map of who is where is built on demand
+  std::vector<Point*> ptr;
+  for (size_t i = 0; i < points.size(); ++i) ptr.push_back(&points[i]);
+  SmartQuadtree<Point*> bulkp(0., 0., 4., 4., 4, ptr.begin(), ptr.end());
+
+  points[0].x += 4.;
+  log.testint(__LINE__, bulkp.updateData(ptr[0]), 1, "bulkp.updateData()");
+  bulkp.removeData(ptr[1]);
+  log.testint(__LINE__, bulkp.rebalance(), 0, "bulkp.rebalance()");
+
+  count = 0;
+  SmartQuadtree<Point*>::const_iterator it = bulkp.begin();
+  for ( ; it != bulkp.end(); ++it) ++count;
+  log.testint(__LINE__, count, 79, "count after removal");
+}
+
+// Counts pairs, and sums a key symmetric in the addresses of both elements
+// of each pair (unsigned: wraps around)
+struct PairChecksum
+{
+  std::atomic<long> count;
+  std::atomic<uintptr_t> sum;
+
+  PairChecksum() : count(0), sum(0) {}
+
+  void operator()(const Point* a, const Point* b)
+  {
+    uintptr_t i = reinterpret_cast<uintptr_t>(a);
+    uintptr_t j = reinterpret_cast<uintptr_t>(b);
+    ++count;
+    sum += (i + 1) * (j + 1) + i + j;
+  }
+};
+
+void Test_SmartQuadtree::RunTest_NeighbourPairs(Logger& log)
+{
+  log.message(__LINE__, "");
+  log.message(__LINE__, "Tests of parallel enumeration of neighbour pairs");
+
+  std::vector<Point> points = scattered(500);
+  SmartQuadtree<Point> q(0., 0., 4., 4., 4, points.begin(), points.end());
+
+  std::vector<float> px, py;
+  px.push_back(-3.); py.push_back(-3.);
+  px.push_back(3.);  py.push_back(-2.);
+  px.push_back(0.);  py.push_back(3.);
+  PolygonMask mask(px, py, 3);
+
+  for (int masked = 0; masked < 2; ++masked)
+  {
+    PairChecksum expected, expectedWithin;
+    SmartQuadtree<Point>::const_iterator it =
+      (masked ? q.masked(&mask).begin() : q.begin());
+    for ( ; it != q.end(); ++it)
+    {
+      std::vector<const Point*>::const_iterator k = it.forward_begin();
+      for ( ; k != it.forward_end(); ++k)
+      {
+        expected(&(*it), *k);
+        float dx = it->x - (*k)->x, dy = it->y - (*k)->y;
+        if (dx * dx + dy * dy < .25) expectedWithin(&(*it), *k);
+      }
+    }
+
+    for (unsigned int threads = 1; threads < 5; threads += 3)
+    {
+      PairChecksum result;
+      if (masked)
+        q.masked(&mask).forEachNeighbourPair(std::ref(result), threads);
+      else
+        q.forEachNeighbourPair(std::ref(result), threads);
+      log.testint(__LINE__, result.count, expected.count,
+                  (masked ? "masked pairs" : "pairs"));
+      log.testint(__LINE__, result.sum == expected.sum, 1,
+                  (masked ? "masked pairs checksum" : "pairs checksum"));
+
+      PairChecksum within;
+      if (masked)
+        q.masked(&mask).pairsWithin(.5, std::ref(within), threads);
+      else
+        q.pairsWithin(.5, std::ref(within), threads);
+      log.testint(__LINE__, within.count, expectedWithin.count,
+                  (masked ? "masked pairs within" : "pairs within"));
+      log.testint(__LINE__, within.sum == expectedWithin.sum, 1,
+                  (masked ? "masked pairs within checksum" :
+                   "pairs within checksum"));
+    }
+  }
+}
+
+// Counts data yielded by a masked iteration, and data inside the mask
+void countMasked(SmartQuadtree<Point>& q, PolygonMask& mask,
+                 int& yielded, int& inside)
+{
+  yielded = inside = 0;
+  SmartQuadtree<Point>::const_iterator it = q.masked(&mask).begin();
+  for ( ; it != q.end(); ++it) ++yielded;
+  SmartQuadtree<Point>::const_iterator jt = q.begin();
+  for ( ; jt != q.end(); ++jt)
+    if (mask.pointInPolygon(jt->x, jt->y)) ++inside;
+}
+
+void Test_SmartQuadtree::RunTest_MaskCoverage(Logger& log)
+{
+  log.message(__LINE__, "");
+  log.message(__LINE__, "Tests of the cache of coverage by masks");
+
+  std::vector<Point> points = scattered(100);
+  SmartQuadtree<Point> q(0., 0., 4., 4., 4);
+  for (size_t i = 0; i < points.size(); ++i) q.insert(points[i]);
+
+  std::vector<float> px, py;
+  px.push_back(-3.); py.push_back(-3.);
+  px.push_back(3.);  py.push_back(-2.);
+  px.push_back(0.);  py.push_back(3.);
+  PolygonMask triangle(px, py, 3);
+  PolygonMask copy(triangle);
+  log.testint(__LINE__, copy.getId(), triangle.getId(), "id of copy");
+
+  int yielded, inside;
+  countMasked(q, triangle, yielded, inside);
+  log.testint(__LINE__, yielded, inside, "masked data");
+  countMasked(q, triangle, yielded, inside);
+  log.testint(__LINE__, yielded, inside, "masked data, cached");
+
+  // Leaves split by insertions have no coverage cached yet
+  unsigned long leaves = q.tree->leaves.size();
+  for (int i = 0; i < 400; ++i)
+    q.insert(Point(-1.95 + 3.9 * ((i * 41) % 103) / 103.,
+                   -1.95 + 3.9 * ((i * 59) % 89) / 89.));
+  log.testint(__LINE__, q.tree->leaves.size() > leaves, 1, "leaves split");
+  countMasked(q, triangle, yielded, inside);
+  log.testint(__LINE__, yielded, inside, "masked data after splits");
+
+  // Another mask replaces the cached coverage
+  px[2] = -3.; py[2] = 3.;
+  PolygonMask other(px, py, 3);
+  countMasked(q, other, yielded, inside);
+  log.testint(__LINE__, yielded, inside, "masked data, other mask");
+  countMasked(q, triangle, yielded, inside);
+  log.testint(__LINE__, yielded, inside, "masked data, first mask again");
+
+  // Whole subtrees are accepted: quadrants with their four corners inside
+  // this U-shaped polygon (the root first) are not inside if the notch
+  // crosses them
+  px.clear(); py.clear();
+  px.push_back(-4.5); py.push_back(-4.5);
+  px.push_back(4.5);  py.push_back(-4.5);
+  px.push_back(4.5);  py.push_back(4.5);
+  px.push_back(1.);   py.push_back(4.5);
+  px.push_back(1.);   py.push_back(-2.);
+  px.push_back(-1.);  py.push_back(-2.);
+  px.push_back(-1.);  py.push_back(4.5);
+  px.push_back(-4.5); py.push_back(4.5);
+  PolygonMask notch(px, py, 8);
+  countMasked(q, notch, yielded, inside);
+  log.testint(__LINE__, yielded, inside, "masked data, concave mask");
+
+  int mutated = 0;
+  SmartQuadtree<Point>::iterator it = q.masked(&notch).begin();
+  for ( ; it != q.end(); ++it) ++mutated;
+  log.testint(__LINE__, mutated, inside, "masked data, mutable iterator");
+
+  // Square with a hole, and an island in the hole: subtrees in the hole are
+  // outside, those in the island inside
+  std::vector<std::vector<float> > ringsX(3), ringsY(3);
+  float squareX[] = { -4.5, 4.5, 4.5, -4.5 };
+  float squareY[] = { -4.5, -4.5, 4.5, 4.5 };
+  float holeX[] = { -3., -3., 3., 3. }, holeY[] = { -3., 3., 3., -3. };
+  float islandX[] = { -1., 1., 1., -1. }, islandY[] = { -1., -1., 1., 1. };
+  ringsX[0].assign(squareX, squareX + 4);
+  ringsY[0].assign(squareY, squareY + 4);
+  ringsX[1].assign(holeX, holeX + 4);
+  ringsY[1].assign(holeY, holeY + 4);
+  ringsX[2].assign(islandX, islandX + 4);
+  ringsY[2].assign(islandY, islandY + 4);
+  PolygonMask holed(ringsX, ringsY);
+  countMasked(q, holed, yielded, inside);
+  log.testint(__LINE__, yielded, inside, "masked data, mask with a hole");
+  log.testint(__LINE__, inside > 0, 1, "data in the mask with a hole");
+
+  // Visited pairs go through the subtrees collected under the mask
+  int expected = 0;
+  SmartQuadtree<Point>::const_iterator kt = q.masked(&holed).begin();
+  for ( ; kt != q.end(); ++kt)
+    expected += kt.forward_end() - kt.forward_begin();
+  int pairs = 0;
+  q.masked(&holed).forEachNeighbourPair(
+    [&pairs](const Point*, const Point*) { ++pairs; }, 1);
+  log.testint(__LINE__, pairs, expected, "masked pairs, mask with a hole");
+}
+
+// Counts data passed to it, and sums their addresses
+struct QueryChecksum
+{
+  int count;
+  unsigned long sum;
+  QueryChecksum() : count(0), sum(0) {}
+  void operator()(const Point* p)
+  { ++count; sum += reinterpret_cast<unsigned long>(p); }
+};
+
+void Test_SmartQuadtree::RunTest_RangeQueries(Logger& log)
+{
+  log.message(__LINE__, "");
+  log.message(__LINE__, "Tests of rectangle and radius queries");
+
+  std::vector<Point> points = scattered(1000);
+  SmartQuadtree<Point> q(0., 0., 4., 4., 8, points.begin(), points.end());
+
+  // The whole tree, one corner, a strip across, borders on data, nothing
+  float step = 7.8 / 101.;
+  Boundary boxes[] = { Boundary(0., 0., 5., 5.), Boundary(2., 2., 1.5, 1.5),
+                       Boundary(0.3, -1., 3.5, .2),
+                       Boundary(-3.9 + 20 * step, 0., 10 * step, 1.),
+                       Boundary(10., 10., 1., 1.) };
+  for (int k = 0; k < 5; ++k)
+  {
+    const Boundary& box = boxes[k];
+    QueryChecksum expected;
+    SmartQuadtree<Point>::const_iterator it = q.begin();
+    for ( ; it != q.end(); ++it)
+      if (it->x >= box.getX() - box.getDimX() &&
+          it->x <= box.getX() + box.getDimX() &&
+          it->y >= box.getY() - box.getDimY() &&
+          it->y <= box.getY() + box.getDimY())
+        expected(&(*it));
+
+    QueryChecksum result;
+    q.queryRect(box, std::ref(result));
+    log.testint(__LINE__, result.count, expected.count, "queryRect count");
+    log.testint(__LINE__, result.sum == expected.sum, 1, "queryRect checksum");
+
+    std::vector<const Point*> out(1, (const Point*) NULL);
+    q.queryRect(box, out);
+    log.testint(__LINE__, out.size(), expected.count + 1,
+                "queryRect appended");
+  }
+
+  float centers[][3] = { { 0., 0., 10. }, { 1., -.5, 1.3 },
+                         { -3.9, 3.9, 2. }, { .2, .1, .05 }, { 9., 9., 1. } };
+  for (int k = 0; k < 5; ++k)
+  {
+    float x = centers[k][0], y = centers[k][1], r = centers[k][2];
+    QueryChecksum expected;
+    SmartQuadtree<Point>::const_iterator it = q.begin();
+    for ( ; it != q.end(); ++it)
+      if ((it->x - x) * (it->x - x) + (it->y - y) * (it->y - y) < r * r)
+        expected(&(*it));
+
+    QueryChecksum result;
+    q.queryRadius(x, y, r, std::ref(result));
+    log.testint(__LINE__, result.count, expected.count, "queryRadius count");
+    log.testint(__LINE__, result.sum == expected.sum, 1,
+                "queryRadius checksum");
+
+    std::vector<const Point*> out;
+    q.queryRadius(x, y, r, out);
+    log.testint(__LINE__, out.size(), expected.count, "queryRadius out");
+  }
+}
+
+void Test_SmartQuadtree::RunTest_Nearest(Logger& log)
+{
+  log.message(__LINE__, "");
+  log.message(__LINE__, "Tests of nearest neighbour searches");
+
+  std::vector<Point> points = scattered(1000);
+  SmartQuadtree<Point> q(0., 0., 4., 4., 8, points.begin(), points.end());
+
+  // Positions inside and outside the tree, in no particular order
+  std::vector<float> x, y;
+  for (int i = 0; i < 60; ++i)
+  {
+    x.push_back(-5. + 10. * ((i * 29) % 61) / 61.);
+    y.push_back(-5. + 10. * ((i * 43) % 59) / 59.);
+  }
+
+  std::size_t ks[] = { 1, 7, 40 };
+  for (int n = 0; n < 3; ++n)
+  {
+    std::size_t k = ks[n];
+    std::vector<const Point*> batch;
+    q.nearest(&x[0], &y[0], x.size(), k, batch);
+
+    int wrong = 0, differ = 0;
+    for (std::size_t i = 0; i < x.size(); ++i)
+    {
+      // Squared distances of all data, the k smallest in order
+      std::vector<float> all;
+      SmartQuadtree<Point>::const_iterator it = q.begin();
+      for ( ; it != q.end(); ++it)
+        all.push_back((it->x - x[i]) * (it->x - x[i]) +
+                      (it->y - y[i]) * (it->y - y[i]));
+      std::sort(all.begin(), all.end());
+
+      std::vector<const Point*> out;
+      q.nearest(x[i], y[i], k, out);
+      if (out.size() != k) ++wrong;
+      for (std::size_t j = 0; j < out.size(); ++j)
+      {
+        float d2 = (out[j]->x - x[i]) * (out[j]->x - x[i]) +
+          (out[j]->y - y[i]) * (out[j]->y - y[i]);
+        if (d2 != all[j]) ++wrong;
+        if (batch[i * k + j] != out[j] &&
+            (batch[i * k + j] == NULL ||
+             (batch[i * k + j]->x - x[i]) * (batch[i * k + j]->x - x[i]) +
+             (batch[i * k + j]->y - y[i]) * (batch[i * k + j]->y - y[i]) !=
+             d2))
+          ++differ;
+      }
+    }
+    log.testint(__LINE__, wrong, 0, "nearest against all data");
+    log.testint(__LINE__, differ, 0, "nearest in batch");
+  }
+
+  // Fewer data than asked for
+  SmartQuadtree<Point> small(0., 0., 4., 4., 8, points.begin(),
+                             points.begin() + 5);
+  std::vector<const Point*> out;
+  small.nearest(0., 0., 8, out);
+  log.testint(__LINE__, out.size(), 5, "nearest, all data");
+  small.nearest(&x[0], &y[0], 2, 8, out);
+  log.testint(__LINE__, out.size(), 16, "nearest in batch, size");
+  log.testint(__LINE__, out[4] != NULL && out[5] == NULL &&
+              out[12] != NULL && out[13] == NULL, 1,
+              "nearest in batch, NULL past the data");
+}
+
+void Test_SmartQuadtree::RunTest_Corridor(Logger& log)
+{
+  log.message(__LINE__, "");
+  log.message(__LINE__, "Tests of queries along a segment");
+
+  // Leaves of very different sizes: dense data in one corner
+  std::vector<Point> points = scattered(400);
+  SmartQuadtree<Point> q(0., 0., 4., 4., 4);
+  for (size_t i = 0; i < points.size(); ++i) q.insert(points[i]);
+  for (int i = 0; i < 400; ++i)
+    q.insert(Point(.5 + 3.4 * ((i * 41) % 103) / 103.,
+                   .5 + 3.4 * ((i * 59) % 89) / 89.));
+
+  // Inside, across, through corners of quadrants, along their sides,
+  // outside but close, a single point
+  float segments[][5] = { { -3., -2., 2.5, 3.1, .3 },
+                          { -6., 1., 6., 1.7, .1 },
+                          { -4., -4., 4., 4., .2 },
+                          { 2., -4., 2., 4., .05 },
+                          { 3.7, 3.2, 1., 1.3, 0. },
+                          { -5., -4.5, 5., -4.5, 1. },
+                          { 1.2, -.7, 1.2, -.7, .8 },
+                          { 3.9, 0.2, -0.4, -3.8, 2.5 } };
+  for (int k = 0; k < 8; ++k)
+  {
+    float* sg = segments[k];
+    SmartQuadtree<Point>::Corridor corridor(sg[0], sg[1], sg[2], sg[3], sg[4]);
+
+    QueryChecksum expected;
+    SmartQuadtree<Point>::const_iterator it = q.begin();
+    for ( ; it != q.end(); ++it)
+      if (corridor.contains(it->x, it->y)) expected(&(*it));
+
+    QueryChecksum result;
+    q.queryCorridor(sg[0], sg[1], sg[2], sg[3], sg[4], std::ref(result));
+    log.testint(__LINE__, result.count, expected.count,
+                "queryCorridor count");
+    log.testint(__LINE__, result.sum == expected.sum, 1,
+                "queryCorridor checksum");
+
+    // The walk goes through the leaves the segment crosses inside, and only
+    // those it touches (on one side only when it runs along their sides)
+    std::vector<const SmartQuadtree<Point>*> walked;
+    q.forEachLeafAlong(sg[0], sg[1], sg[2], sg[3],
+                       [&walked](const SmartQuadtree<Point>* leaf)
+                       { walked.push_back(leaf); });
+    int missed = 0, extra = 0;
+    std::list<SmartQuadtree<Point>*>::const_iterator lt;
+    for (lt = q.tree->leaves.begin(); lt != q.tree->leaves.end(); ++lt)
+    {
+      const Boundary& b = (*lt)->b;
+      double t0 = 0, t1 = 1, u0 = 0, u1 = 1;
+      bool touching = corridor.clip(b, t0, t1);
+      bool crossing = corridor.clip(Boundary(b.getX(), b.getY(),
+                                             b.getDimX() * .999,
+                                             b.getDimY() * .999), u0, u1);
+      bool found = (std::find(walked.begin(), walked.end(), *lt) !=
+                    walked.end());
+      if (crossing && u1 - u0 > 1e-4 && !found) ++missed;
+      if (found && !touching) ++extra;
+    }
+    log.testint(__LINE__, missed, 0, "leaves missed by the walk");
+    log.testint(__LINE__, extra, 0, "leaves off the segment walked");
+
+    int backwards = 0;
+    double last = 0;
+    for (std::size_t i = 0; i < walked.size(); ++i)
+    {
+      double t0 = 0, t1 = 1;
+      corridor.clip(walked[i]->b, t0, t1);
+      if (t0 < last - 1e-6) ++backwards;
+      last = t0;
+    }
+    log.testint(__LINE__, backwards, 0, "leaves walked in order");
+  }
+
+  std::vector<const Point*> out(1, (const Point*) NULL);
+  q.queryCorridor(-3., -2., 2.5, 3.1, .3, out);
+  log.testint(__LINE__, out.size() > 1 && out[0] == NULL, 1,
+              "queryCorridor appended");
+}
+
+template<typename T>
+int Test_SmartQuadtree::staleStats(const SmartQuadtree<T>& q)
+{
+  unsigned long size = 0, fullest = 0;
+  unsigned char depth = 0;
+  typename std::list<SmartQuadtree<T>*>::const_iterator leaf;
+  for (leaf = q.tree->leaves.begin(); leaf != q.tree->leaves.end(); ++leaf)
+  {
+    size += (*leaf)->points.size();
+    fullest = std::max<unsigned long>(fullest, (*leaf)->points.size());
+    depth = std::max(depth, (*leaf)->level);
+  }
+  typename SmartQuadtree<T>::Stats s = q.stats();
+  return (s.size != size) + (s.leaves != q.tree->leaves.size()) +
+    (s.fullest != fullest) + (s.depth != depth) +
+    (q.tree->indexed && q.tree->where.size() != size);
+}
+
+void Test_SmartQuadtree::RunTest_Stats(Logger& log)
+{
+  log.message(__LINE__, "");
+  log.message(__LINE__, "Tests of statistics");
+
+  std::vector<Point> points = scattered(500);
+  std::vector<Point*> ptr;
+  for (size_t i = 0; i < points.size(); ++i) ptr.push_back(&points[i]);
+
+  SmartQuadtree<Point*> q(0., 0., 4., 4., 4);
+  log.testint(__LINE__, staleStats(q), 0, "stats of an empty quadtree");
+  for (size_t i = 0; i < ptr.size(); ++i) q.insert(ptr[i]);
+  log.testint(__LINE__, staleStats(q), 0, "stats after insertions");
+  log.testint(__LINE__, q.stats().size, 500, "q.stats().size");
+  log.testint(__LINE__, q.getDataSize(), q.stats().fullest, "q.getDataSize()");
+  log.testint(__LINE__, q.getDepth(), q.stats().depth, "q.getDepth()");
+
+  // Some data move to other leaves, some leave the quadtree
+  for (size_t i = 0; i < points.size(); i += 3) points[i].x *= 1.1;
+  SmartQuadtree<Point*>::iterator it = q.begin();
+  for ( ; it != q.end(); ++it) ;
+  log.testint(__LINE__, staleStats(q), 0, "stats after a sweep");
+  for (size_t i = 1; i < points.size(); i += 3) points[i].y *= -1.;
+  q.rebalance();
+  log.testint(__LINE__, staleStats(q), 0, "stats after rebalance()");
+
+  for (size_t i = 0; i < points.size(); ++i)
+    if (i % 5 != 0 && std::fabs(points[i].x) < 4.) q.removeData(ptr[i]);
+  log.testint(__LINE__, staleStats(q), 0, "stats after removals");
+  log.testint(__LINE__, q.coarsen(4) > 0, 1, "q.coarsen(4)");
+  log.testint(__LINE__, staleStats(q), 0, "stats after coarsening");
+
+  // Strays of bulk loading are counted as inserted
+  SmartQuadtree<Point> bulk(0., 0., 4., 4., 4,
+                            points.begin(), points.end(), 4);
+  log.testint(__LINE__, staleStats(bulk), 0, "stats after bulk loading");
+  bulk.insert(Point(0.01, 0.01));
+  log.testint(__LINE__, staleStats(bulk), 0, "stats after bulk and insert");
+
+  RunTest_OverCapacity<Point>(log, "node buckets");
+  RunTest_OverCapacity<FlatPoint>(log, "flat buckets");
+
+  // With these seeds, one data is within the tolerance of a quadrant which
+  // splits, but out of all its children: it goes to the neighbour
+  for (unsigned int seed = 11; seed < 17; seed += 5)
+  {
+    std::minstd_rand random(seed);
+    SmartQuadtree<Point> u(50., 50., 50., 50., 8);
+    unsigned long inserted = 0, count = 0;
+    for (int i = 0; i < 100000; ++i)
+    {
+      float x = 100.f * random() / random.max();
+      float y = 100.f * random() / random.max();
+      if (NULL != u.insert(Point(x, y))) ++inserted;
+    }
+    SmartQuadtree<Point>::const_iterator jt = u.begin();
+    for ( ; jt != u.end(); ++jt) ++count;
+    log.testint(__LINE__, count, inserted, "data kept by splits");
+    log.testint(__LINE__, u.stats().size, count, "u.stats().size");
+  }
+}
+
+template<typename P>
+void Test_SmartQuadtree::RunTest_OverCapacity(Logger& log, const char* name)
+{
+  log.message(__LINE__, name);
+
+  // A flat bucket moves as it grows: all addresses of the leaf change
+  // The map of who is where is built by the first removal
+  SmartQuadtree<P> dense(0., 0., 4., 4., 4);
+  P& first = const_cast<P&>(*dense.insert(P(.1, .1)));
+  dense.removeData(first);
+  for (int i = 0; i < 900; ++i)
+    dense.insert(P(.1 + .01 * (i % 30), .1 + .01 * (i / 30)));
+  log.testint(__LINE__, staleStats(dense), 0, "stats over capacity");
+  for (int i = 0; i < 450; ++i)
+  {
+    P& p = *dense.begin();
+    dense.removeData(p);
+  }
+  log.testint(__LINE__, staleStats(dense), 0,
+              "stats after removals over capacity");
+}
+
+// Number of data among one in step of points, from first, which are not in
+// q at the address returned by insert() with the coordinates they should have
+int lostPointers(const SmartQuadtree<Point>& q,
+                 const std::vector<const Point*>& ptr,
+                 const std::vector<Point>& points, size_t first, size_t step)
+{
+  std::set<const Point*> stored;
+  SmartQuadtree<Point>::const_iterator it = q.begin();
+  for ( ; it != q.end(); ++it) stored.insert(&*it);
+  int lost = 0;
+  for (size_t i = first; i < ptr.size(); i += step)
+    lost += (stored.count(ptr[i]) == 0 || ptr[i]->x != points[i].x ||
+             ptr[i]->y != points[i].y);
+  return lost;
+}
+
+void Test_SmartQuadtree::RunTest_Stability(Logger& log)
+{
+  log.message(__LINE__, "");
+  log.message(__LINE__, "Tests of pointers returned by insert()");
+
+  // Data keep their node when their leaf splits
+  std::vector<Point> points = scattered(500);
+  SmartQuadtree<Point> q(0., 0., 4., 4., 4);
+  std::vector<const Point*> ptr;
+  for (size_t i = 0; i < points.size(); ++i)
+    ptr.push_back(q.insert(points[i]));
+  log.testint(__LINE__, lostPointers(q, ptr, points, 0, 1), 0,
+              "pointers kept through splits");
+
+  // ... when they move to another leaf
+  for (size_t i = 0; i < points.size(); ++i)
+    q.access(ptr[i])->x = points[i].x = -points[i].x;
+  log.testint(__LINE__, q.rebalance() > 0, 1, "q.rebalance()");
+  log.testint(__LINE__, lostPointers(q, ptr, points, 0, 1), 0,
+              "pointers kept through rebalance()");
+
+  SmartQuadtree<Point>::iterator it = q.begin();
+  for ( ; it != q.end(); ++it) it->y = -it->y;
+  for (size_t i = 0; i < points.size(); ++i) points[i].y = -points[i].y;
+  log.testint(__LINE__, lostPointers(q, ptr, points, 0, 1), 0,
+              "pointers kept through a sweep");
+
+  // ... when other data are removed, and when leaves merge
+  for (size_t i = 0; i < ptr.size(); ++i)
+    if (i % 10 != 1) q.removeData(*q.access(ptr[i]));
+  log.testint(__LINE__, q.coarsen(4) > 0, 1, "q.coarsen(4)");
+  log.testint(__LINE__, lostPointers(q, ptr, points, 1, 10), 0,
+              "pointers kept through removals and coarsen()");
+  log.testint(__LINE__, q.access(ptr[0]) == NULL, 1,
+              "q.access(ptr[0]) == NULL");
+
+  // ... when updateData() moves them
+  Point* p = q.access(ptr[1]);
+  p->x = points[1].x = (points[1].x < 0) ? 3.5 : -3.5;
+  p->y = points[1].y = (points[1].y < 0) ? 3.5 : -3.5;
+  log.testint(__LINE__, q.updateData(*p), 1, "q.updateData(*p)");
+  log.testint(__LINE__, q.updateData(*p), 0, "q.updateData(*p)");
+  log.testint(__LINE__, lostPointers(q, ptr, points, 1, 10), 0,
+              "pointers kept through updateData()");
+}
+
 int main()
 {
   Logger log(__FILE__);
   Test_SmartQuadtree::RunTest_SmartQuadtree(log);
+  Test_SmartQuadtree::RunTest_Iterator(log);
+  Test_SmartQuadtree::RunTest_Rebalance(log);
+  Test_SmartQuadtree::RunTest_Coarsen(log);
+  Test_SmartQuadtree::RunTest_Bulk(log);
+  Test_SmartQuadtree::RunTest_NeighbourPairs(log);
+  Test_SmartQuadtree::RunTest_MaskCoverage(log);
+  Test_SmartQuadtree::RunTest_RangeQueries(log);
+  Test_SmartQuadtree::RunTest_Nearest(log);
+  Test_SmartQuadtree::RunTest_Corridor(log);
+  Test_SmartQuadtree::RunTest_Stats(log);
+  Test_SmartQuadtree::RunTest_Stability(log);
   return log.reportexit();
 }
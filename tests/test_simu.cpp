@@ -98,8 +98,8 @@ std::ostream& operator<<(std::ostream& os, const SmartQuadtree<Point>& e)
   for (size_t i=0; i<e.level; ++i) os << "  ";
   os << "  " <<
     e.b.center_x << ", " << e.b.center_y <<
-    " (0x" << std::hex << e.location << ") #" << std::dec << e.level << " -> ";
-  std::list<Point>::const_iterator it = e.points.begin(),
+    " (0x" << std::hex << e.location << ") #" << std::dec << (int) e.level << " -> ";
+  BucketType<Point>::type::const_iterator it = e.points.begin(),
     ie = e.points.end();
   for ( ; it != ie; ++it)
     os << (*it) << " ";
@@ -299,9 +299,10 @@ void calculateFPS()
         previousTime = currentTime;
         frameCount = 0;
     }
+    SmartQuadtree<Point>::Stats stats = q->stats();
     std::cout << "\rfps: " << fps <<
-      " size: " << q->getDataSize() <<
-      " depth: " << (int) q->getDepth() <<
+      " size: " << stats.fullest <<
+      " depth: " << (int) stats.depth <<
       " checks: " << checkCount << std::flush;
 }
 